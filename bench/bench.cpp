@@ -0,0 +1,192 @@
+// Overhead & scaling of hwstat's own hot paths.
+//
+//   make            # bench_static (local-exec TLS) and bench_shared (global-dynamic TLS)
+//   make run        # run both
+//   make EXTRA=-DHWSTAT_ARENA run
+//   ./bench_static [max threads] [ops per thread]
+//
+// Every hot path benchmark runs at 1, 2, 4 .. max threads (all cores by default) at the same time
+// and reports the time per operation of one thread, which stays flat as long as it scales. Cycles
+// are tsc cycles. Each result is the best of a few runs.
+
+#include "ops.h"
+
+#include "hwstat.h"
+
+#include <spdlog/sinks/null_sink.h>
+
+#include <cinttypes>
+#include <cstdio>
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr int kRuns = 5;
+// the results are measured with `rdtscp`, whatever clock the stats use
+static double tsc_ghz;
+
+struct Result {
+  double nanos;
+  double cycles;
+};
+
+static void report(const char *name, int threads, const Result &r) {
+  printf("%-22s %8d %10.2f %10.1f\n", name, threads, r.nanos, r.cycles);
+}
+
+// run `fn(ops)` on `threads` threads released together, the best per-op time of one thread
+template <typename F>
+static Result run_threads(int threads, uint64_t ops, F &&fn) {
+  Result best{1e30, 1e30};
+  for (int run = 0; run < kRuns; run++) {
+    std::atomic<int> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> workers;
+    std::vector<Result> results(threads);
+    for (int t = 0; t < threads; t++) {
+      workers.emplace_back([&, t] {
+        // the first use registers the per-thread stats, keep it out of the measurement
+        fn(1);
+        ready++;
+        while (!go.load(std::memory_order_acquire)) {
+        }
+        auto start = Clock::now();
+        auto tsc = hwstat::RdtscpTimerFunc{}();
+        fn(ops);
+        auto cycles = hwstat::RdtscpTimerFunc{}() - tsc;
+        std::chrono::duration<double, std::nano> nanos = Clock::now() - start;
+        results[t] = {nanos.count() / ops, double(cycles) / ops};
+      });
+    }
+    while (ready.load() != threads) {
+      std::this_thread::yield();
+    }
+    go.store(true, std::memory_order_release);
+    for (auto &w : workers) {
+      w.join();
+    }
+    // the slowest thread is the one that limits the throughput
+    Result worst{0, 0};
+    for (auto &r : results) {
+      worst = {std::max(worst.nanos, r.nanos), std::max(worst.cycles, r.cycles)};
+    }
+    if (worst.nanos < best.nanos) {
+      best = worst;
+    }
+  }
+  return best;
+}
+
+// time `fn` on the calling thread, returning the best of a few runs of `n` calls
+template <typename F>
+static Result run_here(uint64_t n, F &&fn) {
+  Result best{1e30, 1e30};
+  for (int run = 0; run < kRuns; run++) {
+    auto start = Clock::now();
+    auto tsc = hwstat::RdtscpTimerFunc{}();
+    for (uint64_t i = 0; i < n; i++) {
+      fn();
+    }
+    auto cycles = hwstat::RdtscpTimerFunc{}() - tsc;
+    std::chrono::duration<double, std::nano> nanos = Clock::now() - start;
+    if (nanos.count() / n < best.nanos) {
+      best = {nanos.count() / n, double(cycles) / n};
+    }
+  }
+  return best;
+}
+
+// the median cost of the first use of a counter by a new thread
+static Result first_touch(int threads) {
+  std::vector<uint64_t> cycles(threads);
+  for (int t = 0; t < threads; t++) {
+    std::thread([&, t] { cycles[t] = ops::first_touch(); }).join();
+  }
+  std::sort(cycles.begin(), cycles.end());
+  auto median = double(cycles[threads / 2]);
+  return {median / tsc_ghz, median};
+}
+
+// `fn` measured while `threads` threads hold live timer instances
+template <typename F>
+static Result with_threads(int threads, uint64_t n, F &&fn) {
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool done = false;
+  std::atomic<int> ready{0};
+  std::vector<std::thread> holders;
+  for (int t = 0; t < threads; t++) {
+    holders.emplace_back([&] {
+      ops::touch();
+      ready++;
+      std::unique_lock<std::mutex> lock(mtx);
+      cv.wait(lock, [&] { return done; });
+    });
+  }
+  while (ready.load() != threads) {
+    std::this_thread::yield();
+  }
+  auto ret = run_here(n, fn);
+  {
+    std::lock_guard<std::mutex> guard(mtx);
+    done = true;
+  }
+  cv.notify_all();
+  for (auto &h : holders) {
+    h.join();
+  }
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  int max_threads = argc > 1 ? atoi(argv[1]) : std::max(1u, std::thread::hardware_concurrency());
+  uint64_t n = argc > 2 ? strtoull(argv[2], nullptr, 10) : 10000000;
+
+  // `print_stats` is measured without the cost of actual output
+  auto null_sink = std::make_shared<spdlog::sinks::null_sink_mt>();
+  auto console = spdlog::default_logger();
+  spdlog::set_default_logger(std::make_shared<spdlog::logger>("bench", null_sink));
+  // detect the frequencies up front
+  hwstat::TimerAgg::freqGhz();
+  tsc_ghz = hwstat::detect_tsc_ghz();
+
+  printf("tls: %s, tsc: %.3fGhz, %" PRIu64 " ops per thread, best of %d\n", ops::tls_model(),
+         tsc_ghz, n, kRuns);
+  printf("%-22s %8s %10s %10s\n", "BENCHMARK", "THREADS", "NS/OP", "CYCLES/OP");
+  std::vector<int> counts;
+  for (int t = 1; t < max_threads; t *= 2) {
+    counts.push_back(t);
+  }
+  counts.push_back(max_threads);
+
+  const std::pair<const char *, void (*)(uint64_t)> hot[] = {
+      {"counter++", ops::counter_inc},
+      {"local_counter++", ops::local_counter_inc},
+      {"stopwatch(rdtsc)", ops::stopwatch_rdtsc},
+      {"stopwatch(rdtscp)", ops::stopwatch_rdtscp},
+      {"stopwatch(fenced)", ops::stopwatch_fenced},
+      {"stopwatch(monotonic)", ops::stopwatch_monotonic},
+      {"stopwatch(coarse)", ops::stopwatch_coarse},
+      {"scoped_timer", ops::scoped_timer},
+  };
+  for (auto &b : hot) {
+    for (auto t : counts) {
+      report(b.first, t, run_threads(t, n, b.second));
+    }
+  }
+  report("first_touch(reg)", 1, first_touch(101));
+  // reads walk every live instance, so they are measured against the number of threads
+  for (auto t : counts) {
+    report("calc_stat", t, with_threads(t, 10000, [] { ops::calc_stat(1); }));
+  }
+  for (auto t : counts) {
+    report("print_stats", t, with_threads(t, 100, ops::print_stats));
+  }
+  // the calling thread's share of it; printing can't keep up, so this is mostly the cost of a
+  // dropped report, which takes no snapshot
+  for (auto t : counts) {
+    report("print_stats_async", t, with_threads(t, 100, ops::print_stats_async));
+    ops::flush_prints();
+  }
+  spdlog::set_default_logger(console);
+  return 0;
+}
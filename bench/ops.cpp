@@ -0,0 +1,82 @@
+#include "ops.h"
+
+#include "hwstat.h"
+
+COUNTER(benchCounter, "incremented by the counter benchmarks")
+COUNTER(firstTouchCounter, "used once per thread by the first touch benchmark")
+TIMER(benchTimer, "started & stopped by the stopwatch benchmarks")
+
+namespace ops {
+
+// position independent executables still use local-exec for their own thread locals
+const char *tls_model() {
+#ifdef HWSTAT_ARENA
+#if defined(__PIC__) && !defined(__PIE__)
+  return "arena, global-dynamic";
+#else
+  return "arena, local-exec";
+#endif
+#else
+#if defined(__PIC__) && !defined(__PIE__)
+  return "global-dynamic";
+#else
+  return "local-exec";
+#endif
+#endif
+}
+
+void counter_inc(uint64_t n) {
+  for (uint64_t i = 0; i < n; i++) {
+    benchCounter++;
+  }
+}
+
+void local_counter_inc(uint64_t n) {
+  hwstat::LocalCounter local(benchCounter);
+  for (uint64_t i = 0; i < n; i++) {
+    local++;
+  }
+}
+
+template <typename TimerFunc>
+static void stopwatch(uint64_t n) {
+  for (uint64_t i = 0; i < n; i++) {
+    hwstat::BasicStopwatch<hwstat::TimerType, TimerFunc> sw(benchTimer);
+    sw.stop();
+  }
+}
+
+void stopwatch_rdtsc(uint64_t n) { stopwatch<hwstat::RdtscTimerFunc>(n); }
+void stopwatch_rdtscp(uint64_t n) { stopwatch<hwstat::RdtscpTimerFunc>(n); }
+void stopwatch_fenced(uint64_t n) { stopwatch<hwstat::FencedTscTimerFunc>(n); }
+void stopwatch_monotonic(uint64_t n) { stopwatch<hwstat::MonotonicTimerFunc>(n); }
+void stopwatch_coarse(uint64_t n) { stopwatch<hwstat::CoarseTimerFunc>(n); }
+
+void scoped_timer(uint64_t n) {
+  for (uint64_t i = 0; i < n; i++) {
+    hwstat::ScopedTimer timer(benchTimer);
+  }
+}
+
+void touch() { benchTimer.add(0); }
+
+uint64_t first_touch() {
+  hwstat::RdtscpTimerFunc clock;
+  auto start = clock();
+  firstTouchCounter++;
+  return clock() - start;
+}
+
+void calc_stat(uint64_t n) {
+  uint64_t sink = 0;
+  for (uint64_t i = 0; i < n; i++) {
+    sink += benchTimer.stat().cnt;
+  }
+  asm volatile("" : : "r"(sink));
+}
+
+void print_stats() { hwstat::print_stats(); }
+void print_stats_async() { hwstat::print_stats_async(); }
+void flush_prints() { hwstat::AsyncPrinter::get().flush(); }
+
+} // namespace ops
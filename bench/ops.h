@@ -0,0 +1,35 @@
+// The operations measured by bench.cpp. They live in their own translation unit so that the
+// Makefile can link them either into the executable or from a shared library, which changes the
+// TLS model used to reach the per-thread stats.
+
+#pragma once
+
+#include <cstdint>
+
+namespace ops {
+
+// how the stats' thread locals are reached
+const char *tls_model();
+
+void counter_inc(uint64_t n);
+void local_counter_inc(uint64_t n);
+void stopwatch_rdtsc(uint64_t n);
+void stopwatch_rdtscp(uint64_t n);
+void stopwatch_fenced(uint64_t n);
+void stopwatch_monotonic(uint64_t n);
+void stopwatch_coarse(uint64_t n);
+void scoped_timer(uint64_t n);
+
+// use the timer once on the calling thread, e.g. to keep an instance alive for `calc_stat`
+void touch();
+// cycles taken by the first use of a counter on the calling thread, TLS init & `reg()` included
+uint64_t first_touch();
+
+void calc_stat(uint64_t n);
+void print_stats();
+// queue a report and return, printing is left to the printer thread
+void print_stats_async();
+// wait for the queued reports
+void flush_prints();
+
+} // namespace ops
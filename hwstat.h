@@ -1,13 +1,45 @@
 #ifndef _HWSTAT_H
 #define _HWSTAT_H
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cmath>
 #include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <functional>
+#include <iterator>
+#include <limits>
 #include <map>
+#include <memory>
 #include <mutex>
-#include <set>
+#include <optional>
+#include <string>
 #include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
 #include <spdlog/spdlog.h>
 
@@ -15,59 +47,399 @@
 // #define NO_STAT
 
 /** use `rdtscp` instructin instead of `rdtsc`
- * `rdtscp` will flush the processor pipeline before taking the time while `rdtsc` would not. This
- * would introduce a little more overhead than `rdtsc`, but more accurate results.
+ * `rdtscp` waits for all earlier instructions to execute before taking the time while `rdtsc`
+ * would not. Later instructions may still start before it; use `FencedTscTimerFunc` for a timer
+ * that needs the region fenced at both ends. A little more overhead than `rdtsc`.
  */
 // #define USE_RDTSCP
 
 /** predefine frequency of `rdtsc` instruction
- * if not defined, the frequency will be measured automatically everytime the program starts(takes
- * about 10ms)
+ * if not defined, the frequency is taken from the `HWSTAT_TSC_GHZ` environment variable, the kernel
+ * (through the perf mmap page, as calibrated at boot) or CPUID, whose nominal frequency can be off
+ * by a fraction of a percent, in that order. It is only measured (takes about 10ms) as a last
+ * resort, on first use rather than at startup.
  */
 // #define TSC_FREQ_GHZ 2.3
 
+/** clock of all timers instead of the tsc, for machines whose tsc isn't reliable
+ * `HWSTAT_CLOCK_MONOTONIC` reads `clock_gettime(CLOCK_MONOTONIC)` through the vDSO and
+ * `HWSTAT_CLOCK_COARSE` `CLOCK_MONOTONIC_COARSE`, which is cheaper but only ticks every few ms;
+ * both count nanoseconds. `HWSTAT_CLOCK_AUTO` keeps the tsc if CPUID reports it invariant and
+ * reading it isn't trapped by a hypervisor (checked once, see `tsc_reliable`), and falls back to
+ * `CLOCK_MONOTONIC` otherwise. The explicit tsc timer functions (`FencedTscTimerFunc`, ...) still
+ * read the tsc, so don't pick them for a stopwatch along with one of these.
+ * On ARM64 the tsc functions read the virtual counter `cntvct_el0`, at the rate of `cntfrq_el0`.
+ */
+// #define HWSTAT_CLOCK_MONOTONIC
+// #define HWSTAT_CLOCK_COARSE
+// #define HWSTAT_CLOCK_AUTO
+
+/** subtract the measurement overhead from every `Stopwatch` sample
+ * The cost of an empty start/stop is calibrated on the first use of each timer function (or by
+ * `calibrate_overhead`) and taken off each timed segment (every `pause`), clamped at 0. Timers also
+ * keep the unadjusted total, see `TimerAgg::getRawCycles`.
+ */
+// #define HWSTAT_SUBTRACT_OVERHEAD
+
+/** start with all stats switched off at runtime
+ * Instrumentation stays compiled in and costs a single predictable branch until it's switched on
+ * with `hwstat::set_enabled(true)`.
+ */
+// #define HWSTAT_START_DISABLED
+
+/** trace mode: record every stopped `Stopwatch` & `ScopedTimer` as an event
+ * While a `TraceWriter` runs, each stop also appends (stat, start tsc, duration) to a per-thread
+ * lock-free ring of `HWSTAT_TRACE_RING` events (4096 if not defined, a power of two) that the
+ * writer drains to a binary file; tools/trace2json.cpp converts it to Chrome trace JSON. A full
+ * ring drops and counts the event instead of blocking.
+ */
+// #define HWSTAT_TRACE
+// #define HWSTAT_TRACE_RING 4096
+
+/** call tree mode: attribute nested `Stopwatch` & `ScopedTimer` regions to their call path
+ * Each thread keeps a stack of running stopwatches, so every timer also records its inclusive &
+ * exclusive (self) cycles per call path; `print_tree_stats()` prints them as an indented tree.
+ * A thread tracks up to `HWSTAT_TREE_NODES` distinct call paths (512 if not defined), regions
+ * must stop in reverse order of starting.
+ */
+// #define HWSTAT_TREE
+// #define HWSTAT_TREE_NODES 512
+
+/** size of the per-CPU & per-NUMA-node breakdown of `CPU_TIMER`s
+ * CPUs & nodes are identified by `rdtscp`'s `IA32_TSC_AUX`, which Linux sets to the cpu & node
+ * number. A `CPU_TIMER` takes 16 bytes of thread local storage per CPU & node, regions on CPUs
+ * (nodes) numbered `HWSTAT_MAX_CPUS` (`HWSTAT_MAX_NODES`) or above only add to the totals.
+ */
+// #define HWSTAT_MAX_CPUS 256
+// #define HWSTAT_MAX_NODES 8
+
+/** per-thread view of timers & counters
+ * Every `TIMER` & `COUNTER` instance remembers the thread that registered it (tid, and name as set
+ * with `pthread_setname_np` by then), so snapshots also break them down by thread and
+ * `print_thread_stats()` shows each thread's share. The values of the last `HWSTAT_EXITED_THREADS`
+ * exited threads (64 if not defined) are kept. Costs a pointer per instance and nothing on update,
+ * not available with `HWSTAT_ARENA`. Only `TIMER` & `COUNTER` are broken down, the other timer
+ * kinds, gauges and user stats are not.
+ */
+// #define HWSTAT_THREAD_STATS
+// #define HWSTAT_EXITED_THREADS 64
+
+/** align every per-thread counter & timer to its own cache line
+ * Keeps the slots written by the owning thread off the lines holding other stats, at the cost of
+ * 64 bytes of thread local storage per stat.
+ */
+// #define HWSTAT_CACHELINE_ALIGN
+
+/** keep all counters & timers of a thread in one contiguous arena
+ * Every `COUNTER` and `TIMER` gets a fixed index into a per-thread array of slots when it's
+ * registered, and a thread reaches its array through a single constant-initialized TLS pointer:
+ * an update is one load and one add, with no TLS init guard and hot stats packed into few cache
+ * lines. The counter & timer variables become plain globals. Each thread's arena has room for
+ * `HWSTAT_ARENA_SLOTS` slots (a counter takes 1, a timer 2), 1024 if not defined.
+ */
+// #define HWSTAT_ARENA
+// #define HWSTAT_ARENA_SLOTS 1024
+
+#ifdef HWSTAT_CACHELINE_ALIGN
+#define _HWSTAT_SLOT_ALIGN alignas(hwstat::kCacheLineSize)
+#else
+#define _HWSTAT_SLOT_ALIGN
+#endif
+
+// storage of the variables defined by `COUNTER` & `TIMER`
+#ifdef HWSTAT_ARENA
+#define _HWSTAT_LOCAL
+#else
+#define _HWSTAT_LOCAL thread_local
+#endif
+
 namespace hwstat {
 
+constexpr size_t kCacheLineSize = 64;
+
+/** single-writer value that other threads may read concurrently
+ * Only the owning thread writes, so updates are a relaxed load + add + store, which compiles to the
+ * same plain instructions as a bare `uint64_t` (no `lock` prefix) while keeping readers race-free.
+ */
+template <typename V>
+class BasicSlot {
+  std::atomic<V> v;
+
+public:
+  constexpr BasicSlot(V init = V{}) : v(init) {}
+  V load() const { return v.load(std::memory_order_relaxed); }
+  V add(V d) {
+    auto n = load() + d;
+    v.store(n, std::memory_order_relaxed);
+    return n;
+  }
+  void store(V n) { v.store(n, std::memory_order_relaxed); }
+};
+
+using Slot = BasicSlot<uint64_t>;
+
+/** epoch-based read-side protection
+ * Readers never block writers. A remover unlinks a node and then calls `synchronize()`, which waits
+ * until every reader that might still hold a pointer to that node has left its read-side section.
+ * Removers must be serialized by the caller.
+ */
+class Epoch {
+  std::atomic<uint64_t> epoch{0};
+  std::atomic<uint64_t> readers[2]{};
+
+public:
+  unsigned enter() {
+    for (;;) {
+      auto e = epoch.load();
+      readers[e & 1].fetch_add(1);
+      if (epoch.load() == e) {
+        return e & 1;
+      }
+      // a remover flipped the epoch in between, retry on the new parity
+      readers[e & 1].fetch_sub(1);
+    }
+  }
+  void exit(unsigned slot) { readers[slot].fetch_sub(1, std::memory_order_release); }
+  void synchronize() {
+    auto e = epoch.fetch_add(1);
+    while (readers[e & 1].load() != 0) {
+      std::this_thread::yield();
+    }
+  }
+};
+
+class EpochGuard {
+  Epoch &epoch;
+  unsigned slot;
+
+public:
+  EpochGuard(Epoch &epoch) : epoch(epoch), slot(epoch.enter()) {}
+  ~EpochGuard() { epoch.exit(slot); }
+  EpochGuard(const EpochGuard &) = delete;
+  EpochGuard(EpochGuard &&) = delete;
+};
+
+/** intrusive singly-linked list of instances
+ * `T` embeds the link as `std::atomic<T *> reg_next`, so neither `push` nor `remove` allocates.
+ * `push` is lock-free and may race with anything. `remove` calls must be serialized by the caller,
+ * and `forEach` must run inside an `EpochGuard` of the epoch the remover synchronizes on.
+ */
+template <typename T>
+class RegList {
+  std::atomic<T *> head{nullptr};
+
+public:
+  void push(T *node) {
+    T *h = head.load(std::memory_order_relaxed);
+    do {
+      node->reg_next.store(h, std::memory_order_relaxed);
+    } while (!head.compare_exchange_weak(h, node, std::memory_order_release,
+                                         std::memory_order_relaxed));
+  }
+  void remove(T *node) {
+    T *next = node->reg_next.load(std::memory_order_relaxed);
+    T *expected = node;
+    if (head.compare_exchange_strong(expected, next)) {
+      return;
+    }
+    // `push` only ever modifies `head`, so with removals serialized the predecessor is stable
+    for (T *p = head.load(std::memory_order_acquire); p;
+         p = p->reg_next.load(std::memory_order_relaxed)) {
+      if (p->reg_next.load(std::memory_order_relaxed) == node) {
+        p->reg_next.store(next);
+        return;
+      }
+    }
+    assert(false && "removing an unregistered instance");
+  }
+  template <typename F>
+  void forEach(F &&f) const {
+    for (T *p = head.load(std::memory_order_acquire); p;
+         p = p->reg_next.load(std::memory_order_acquire)) {
+      f(p);
+    }
+  }
+};
+
+/** runtime on/off switch of a stat
+ * A stat is active when both it and the global switch are on. The two are folded into a single
+ * relaxed flag whenever either changes, so the hot path checks one read-mostly byte.
+ */
+class Toggle {
+  const char *name;
+  bool local = true; // guarded by the registry lock
+  std::atomic<bool> active;
+
+  struct Registry {
+    std::mutex mtx;
+#ifdef HWSTAT_START_DISABLED
+    bool global = false;
+#else
+    bool global = true;
+#endif
+    std::vector<Toggle *> toggles;
+  };
+  static Registry &registry() {
+    static Registry r;
+    return r;
+  }
+
+public:
+  Toggle(const char *name) : name(name) {
+    auto &r = registry();
+    std::lock_guard<std::mutex> guard(r.mtx);
+    active.store(r.global, std::memory_order_relaxed);
+    r.toggles.push_back(this);
+  }
+  ~Toggle() {
+    auto &r = registry();
+    std::lock_guard<std::mutex> guard(r.mtx);
+    r.toggles.erase(std::find(r.toggles.begin(), r.toggles.end(), this));
+  }
+  Toggle(const Toggle &) = delete;
+  Toggle(Toggle &&) = delete;
+  bool isActive() const { return active.load(std::memory_order_relaxed); }
+  void setEnabled(bool on) {
+    auto &r = registry();
+    std::lock_guard<std::mutex> guard(r.mtx);
+    local = on;
+    active.store(r.global && local, std::memory_order_relaxed);
+  }
+  static void setGlobal(bool on) {
+    auto &r = registry();
+    std::lock_guard<std::mutex> guard(r.mtx);
+    r.global = on;
+    for (auto *t : r.toggles) {
+      t->active.store(on && t->local, std::memory_order_relaxed);
+    }
+  }
+  static bool global() {
+    auto &r = registry();
+    std::lock_guard<std::mutex> guard(r.mtx);
+    return r.global;
+  }
+  // switch every stat called `name`, returns false if there is none
+  static bool setEnabled(const char *name, bool on) {
+    auto &r = registry();
+    std::lock_guard<std::mutex> guard(r.mtx);
+    bool found = false;
+    for (auto *t : r.toggles) {
+      if (std::strcmp(t->name, name) == 0) {
+        t->local = on;
+        t->active.store(r.global && on, std::memory_order_relaxed);
+        found = true;
+      }
+    }
+    return found;
+  }
+};
+
+/** switch all stats on or off at runtime, see `HWSTAT_START_DISABLED` */
+inline void set_enabled(bool on) { Toggle::setGlobal(on); }
+/** switch the stats called `name` on or off, returns false if there is none */
+inline bool set_enabled(const char *name, bool on) { return Toggle::setEnabled(name, on); }
+inline bool is_enabled() { return Toggle::global(); }
+
+/** whether `T` adds itself to an aggregate in place rather than through `aggregate` */
+template <typename T, typename = void>
+struct HasAggregateInto : std::false_type {};
+
+template <typename T>
+struct HasAggregateInto<
+    T, std::void_t<decltype(std::declval<T &>().aggregateInto(
+           std::declval<typename T::AggregateType &>()))>> : std::true_type {};
+
 template <typename T>
 struct GlobalStat {
   const char *name;
   const char *desc;
+  // serializes `dereg` and guards `agg`, never taken by `reg`
   std::mutex mtx;
-  std::set<T *> instances;
+  RegList<T> instances;
+  Epoch epoch;
+  // bumped by every `dereg` so that readers can detect a concurrent fold into `agg`
+  std::atomic<uint64_t> retired{0};
   typename T::AggregateType agg;
-  GlobalStat(const char *name, const char *desc = "") : name(name), desc(desc) {
+  Toggle toggle;
+  GlobalStat(const char *name, const char *desc = "") : name(name), desc(desc), toggle(name) {
     assert(name);
-    std::lock_guard<std::mutex> guard(gMtx);
-    stats.emplace(name, this);
+    auto &r = registry();
+    std::lock_guard<std::mutex> guard(r.mtx);
+    r.stats.emplace(name, this);
   }
   ~GlobalStat() {
-    std::lock_guard<std::mutex> guard(gMtx);
-    stats.erase(name);
+    auto &r = registry();
+    std::lock_guard<std::mutex> guard(r.mtx);
+    r.stats.erase(name);
   }
   GlobalStat(const GlobalStat &) = delete;
   GlobalStat(GlobalStat &&) = delete;
-  void reg(T *instance) {
-    std::lock_guard<std::mutex> guard(mtx);
-    instances.insert(instance);
-  }
+  bool active() const { return toggle.isActive(); }
+  void setEnabled(bool on) { toggle.setEnabled(on); }
+  void reg(T *instance) { instances.push(instance); }
   void dereg(T *instance) {
     std::lock_guard<std::mutex> guard(mtx);
-    agg = instance->aggregate(agg);
-    instances.erase(instance);
+    fold(instance, agg);
+    instances.remove(instance);
+    retired.fetch_add(1);
+    // the instance is freed once its thread exits, wait for readers still walking over it
+    epoch.synchronize();
   }
   typename T::AggregateType calcStat() {
-    auto nagg = agg;
-    std::lock_guard<std::mutex> guard(mtx);
-    for (auto i : instances) {
-      nagg = i->aggregate(nagg);
+    for (int attempt = 0;; attempt++) {
+      std::unique_lock<std::mutex> guard(mtx);
+      auto nagg = agg;
+      auto seen = retired.load(std::memory_order_relaxed);
+      // under heavy thread churn, stop retrying and hold off `dereg` for the walk
+      bool locked = attempt >= kMaxRetries;
+      if (!locked) {
+        guard.unlock();
+      }
+      {
+        EpochGuard eg(epoch);
+        instances.forEach([&](T *i) { fold(i, nagg); });
+      }
+      if (locked || retired.load() == seen) {
+        return nagg;
+      }
     }
-    return nagg;
+  }
+  // visit the live per-thread instances, which `f` must not hold on to
+  template <typename F>
+  void forEachInstance(F &&f) {
+    EpochGuard eg(epoch);
+    instances.forEach(f);
   }
   static void printStats();
+  template <typename F>
+  static void forEach(F &&f) {
+    auto &r = registry();
+    std::lock_guard<std::mutex> guard(r.mtx);
+    for (const auto &kv : r.stats) {
+      f(kv.second);
+    }
+  }
 
 private:
-  static inline std::map<const char *, GlobalStat *> stats;
-  static inline std::mutex gMtx;
+  static constexpr int kMaxRetries = 3;
+  // large aggregates (e.g. `CpuAgg`) are better not copied twice per instance
+  static void fold(T *instance, typename T::AggregateType &agg) {
+    if constexpr (HasAggregateInto<T>::value) {
+      instance->aggregateInto(agg);
+    } else {
+      agg = instance->aggregate(agg);
+    }
+  }
+  struct Registry {
+    std::mutex mtx;
+    std::map<const char *, GlobalStat *> stats;
+  };
+  // static members of a class template are initialized in unspecified order, so the registry is
+  // constructed on first use instead
+  static Registry &registry() {
+    static Registry r;
+    return r;
+  }
 };
 
 struct SimpleStat {
@@ -87,178 +459,2743 @@ struct SimpleStat {
     stats.erase(name);
   }
   static void printStats();
+  template <typename F>
+  static void forEach(F &&f) {
+    std::lock_guard<std::mutex> guard(gMtx);
+    for (const auto &kv : stats) {
+      f(kv.second);
+    }
+  }
 
 private:
   static inline std::map<const char *, SimpleStat *> stats;
   static inline std::mutex gMtx;
 };
 
-struct RdtscTimerFunc {
-  uint64_t operator()() {
-    uint64_t a, d;
-    asm volatile("rdtsc" : "=a"(a), "=d"(d));
-    return a | (d << 32);
+/** value of a `NumericStat` */
+struct NumericValue {
+  bool real = false;
+  // see `NumericStat`
+  bool total = false;
+  int64_t i = 0;
+  double d = 0;
+  double get() const { return real ? d : double(i); }
+  // `buf` holding the formatted value
+  const char *format(char (&buf)[32]) const {
+    auto r = real ? fmt::format_to_n(buf, sizeof(buf) - 1, "{}", d)
+                  : fmt::format_to_n(buf, sizeof(buf) - 1, "{}", i);
+    *r.out = '\0';
+    return buf;
   }
 };
 
-struct RdtscpTimerFunc {
-  uint64_t operator()() {
-    uint64_t a, d;
-    asm volatile("rdtscp" : "=a"(a), "=d"(d));
-    return a | (d << 32);
+/** user stat with a numeric value
+ * Unlike `SimpleStat`, the callback is a plain function returning an integer or floating point
+ * number (a lambda without captures converts to one), so evaluating it never allocates and the
+ * value takes part in `diff`, rates and the exporters. A total (`TOTAL_STAT`) only grows, e.g. a
+ * count kept by another library, and is diffed over intervals; any other value is a level, of
+ * which `diff` keeps the newer one.
+ */
+class NumericStat {
+  using RawFunc = void (*)();
+  RawFunc fn;
+  NumericValue (*eval)(RawFunc);
+
+public:
+  const char *name;
+  const char *desc;
+  bool total;
+  template <typename F>
+  NumericStat(const char *name, F f, const char *desc = "", bool total = false)
+      : name(name), desc(desc), total(total) {
+    using P = decltype(+f);
+    using R = decltype((+f)());
+    static_assert(std::is_arithmetic_v<R>, "numeric stats return an integer or floating point");
+    // a function pointer converts to another function pointer type and back losslessly
+    fn = reinterpret_cast<RawFunc>(+f);
+    eval = [](RawFunc raw) {
+      NumericValue v;
+      auto x = reinterpret_cast<P>(raw)();
+      if constexpr (std::is_floating_point_v<R>) {
+        v.real = true;
+        v.d = x;
+      } else {
+        v.i = int64_t(x);
+      }
+      return v;
+    };
+    std::lock_guard<std::mutex> guard(gMtx);
+    stats.insert({name, this});
+  }
+  NumericStat(const NumericStat &) = delete;
+  NumericStat(NumericStat &&) = delete;
+  ~NumericStat() {
+    std::lock_guard<std::mutex> guard(gMtx);
+    stats.erase(name);
+  }
+  NumericValue value() const {
+    auto v = eval(fn);
+    v.total = total;
+    return v;
+  }
+  static void printStats();
+  template <typename F>
+  static void forEach(F &&f) {
+    std::lock_guard<std::mutex> guard(gMtx);
+    for (const auto &kv : stats) {
+      f(kv.second);
+    }
   }
-};
 
-static inline double measure_tsc_ghz(int sleep_ms = 10) {
-#ifdef NO_STAT
-  return 0.0;
-#endif
-#ifdef TSC_FREQ_GHZ
-  spdlog::info("predefined tsc frequency as {:.3}Ghz", TSC_FREQ_GHZ);
-  return TSC_FREQ_GHZ;
-#else
-  auto timer_func = RdtscTimerFunc{};
-  auto start_clk = std::chrono::high_resolution_clock::now();
-  unsigned long start = timer_func();
-  std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
-  auto end_clk = std::chrono::high_resolution_clock::now();
-  unsigned long end = timer_func();
-  auto count_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end_clk - start_clk).count();
-  auto ret = double(end - start) / count_ns;
-  spdlog::info("measured tsc frequency as {:.3}Ghz", ret);
-  return ret;
-#endif
-}
+private:
+  static inline std::map<const char *, NumericStat *> stats;
+  static inline std::mutex gMtx;
+};
 
-struct TimerAgg {
-  uint64_t cnt = 0;
-  uint64_t cycles = 0;
-  static inline double kFreqGhz = measure_tsc_ghz();
-  double getNanos() const { return cycles / kFreqGhz; }
-  uint64_t getAvgCycles() const { return cycles / cnt; }
-  double getAvgNanos() const { return getNanos() / cnt; }
+/** value of a `DerivedStat`, NaN if it's undefined (e.g. no ops) */
+struct DerivedValue {
+  double value = std::numeric_limits<double>::quiet_NaN();
+  // nanoseconds per op rather than a plain ratio
+  bool per_op = false;
 };
 
-struct PerThreadTimer {
-  using GlobalTimer = GlobalStat<PerThreadTimer>;
-  using AggregateType = TimerAgg;
-  uint64_t cycles = 0;
-  uint64_t cnt = 0;
-  GlobalTimer *global_timer;
-  PerThreadTimer(GlobalTimer *globalTimer) : global_timer(globalTimer) { globalTimer->reg(this); }
-  PerThreadTimer(const PerThreadTimer &) = delete;
-  PerThreadTimer(PerThreadTimer &&) = delete;
-  ~PerThreadTimer() { global_timer->dereg(this); }
-  void add(uint64_t dc = 0) {
-    cycles += dc;
-    cnt++;
+/** stat computed from two other stats of the same snapshot, see `RATIO` & `PER_OP`
+ * Each operand is resolved to the registered stat of that name on first use (namespace qualifiers
+ * aside), a missing one is logged once and reads as NaN. In a snapshot the operands are then taken
+ * from the entries already aggregated, so a derived stat costs a lookup and a division whatever
+ * the number of threads. A counter, gauge or numeric stat contributes its value and a timer its
+ * time in nanoseconds. In a `diff` the ratio is taken of the differences, e.g. the hit rate over
+ * the interval.
+ */
+class DerivedStat {
+public:
+  enum Op { Ratio, PerOp };
+  // the snapshot list an operand is found in
+  enum Kind { Counter, Gauge, Numeric, Timer, Moments, Histogram, Sampled, Cpu, Metrics };
+  struct Operand {
+    // as written, e.g. `ns::hits`
+    const char *token;
+    // name of the resolved stat, which its snapshot entries point to, null until resolved
+    const char *stat = nullptr;
+    Kind kind = Counter;
+    bool warned = false;
+    Operand(const char *token) : token(token) {}
+  };
+  const char *name;
+  Operand num;
+  Operand den;
+  Op op;
+  const char *desc;
+  DerivedStat(const char *name, Op op, const char *num, const char *den, const char *desc = "")
+      : name(name), num(num), den(den), op(op), desc(desc) {
+    std::lock_guard<std::mutex> guard(gMtx);
+    stats.insert({name, this});
   }
-  AggregateType aggregate(AggregateType prev) {
-    prev.cnt += cnt;
-    prev.cycles += cycles;
-    return prev;
+  DerivedStat(const DerivedStat &) = delete;
+  DerivedStat(DerivedStat &&) = delete;
+  ~DerivedStat() {
+    std::lock_guard<std::mutex> guard(gMtx);
+    stats.erase(name);
   }
-  AggregateType stat() { return global_timer->calcStat(); }
+  template <typename F>
+  static void forEach(F &&f) {
+    std::lock_guard<std::mutex> guard(gMtx);
+    for (const auto &kv : stats) {
+      f(kv.second);
+    }
+  }
+
+private:
+  static inline std::map<const char *, DerivedStat *> stats;
+  static inline std::mutex gMtx;
 };
 
-struct NoopTimer {
-  using GlobalTimer = GlobalStat<NoopTimer>;
-  using AggregateType = TimerAgg;
-  NoopTimer(GlobalTimer *timer) {}
-  NoopTimer(const NoopTimer &) = delete;
-  NoopTimer(NoopTimer &&) = delete;
-  ~NoopTimer() {}
-  void add(uint64_t dc = 0) {}
-  AggregateType aggregate(AggregateType prev) { return AggregateType{}; }
-  AggregateType stat() { return AggregateType{}; }
+/** `clock_gettime(CLOCK_MONOTONIC)` in nanoseconds, served by the vDSO without a syscall */
+struct MonotonicTimerFunc {
+  uint64_t operator()() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
 };
 
-struct PerThreadCounter {
-  using GlobalCounter = GlobalStat<PerThreadCounter>;
-  using AggregateType = uint64_t;
-  uint64_t cnt = 0;
-  GlobalCounter *global_counter;
-  PerThreadCounter(GlobalCounter *globalCounter) : global_counter(globalCounter) {
-    globalCounter->reg(this);
+/** `clock_gettime(CLOCK_MONOTONIC_COARSE)` in nanoseconds
+ * Cheaper than `MonotonicTimerFunc` as it doesn't read any hardware counter, but it only advances
+ * once per scheduler tick (a few ms), so it suits long regions only.
+ */
+struct CoarseTimerFunc {
+  uint64_t operator()() {
+    timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
   }
-  PerThreadCounter(const PerThreadCounter &) = delete;
-  PerThreadCounter(PerThreadTimer &&) = delete;
-  ~PerThreadCounter() { global_counter->dereg(this); }
-  void add(int d = 1) { cnt += d; }
-  uint64_t operator++() { return ++cnt; }
-  uint64_t operator++(int) { return cnt++; }
-  uint64_t operator+=(uint64_t d) { return cnt += d; }
-  AggregateType aggregate(AggregateType prev) { return prev + cnt; }
-  AggregateType stat() { return global_counter->calcStat(); }
 };
 
-struct NoopCounter {
-  using GlobalCounter = GlobalStat<NoopCounter>;
-  using AggregateType = uint64_t;
-  NoopCounter(GlobalCounter *globalCounter) {}
-  NoopCounter(const NoopCounter &) = delete;
-  NoopCounter(NoopCounter &&) = delete;
-  ~NoopCounter() {}
-  void add(int d = 1) {}
-  uint64_t operator++() { return 0; }
-  uint64_t operator++(int) { return 0; }
-  uint64_t operator+=(uint64_t d) { return 0; }
-  AggregateType aggregate(AggregateType prev) { return AggregateType{}; }
-  AggregateType stat() { return AggregateType{}; }
+#ifdef __aarch64__
+/** ARM64 virtual counter, which runs at the constant rate of `cntfrq_el0` */
+struct CntvctTimerFunc {
+  uint64_t operator()() {
+    uint64_t v;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+  }
+  // wait for earlier instructions before reading, the counterpart of `rdtscp`
+  uint64_t fenced() {
+    uint64_t v;
+    asm volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(v)::"memory");
+    return v;
+  }
+  static double freqGhz() {
+    uint64_t f;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(f));
+    return f / 1e9;
+  }
 };
+#endif
 
-#ifndef NO_STAT
-using CounterType = PerThreadCounter;
-using TimerType = PerThreadTimer;
+// cpu the calling thread runs on, where `rdtscp` can't tell
+static inline uint32_t current_cpu() {
+#ifdef __linux__
+  int cpu = sched_getcpu();
+  return cpu < 0 ? 0 : cpu;
 #else
-using CounterType = NoopCounter;
-using TimerType = NoopTimer;
+  return 0;
 #endif
+}
 
-template <typename TimerFunc = RdtscTimerFunc>
-class StopwatchBase {
-  TimerType &timer;
-  TimerFunc timer_func;
-  uint64_t st;
-  uint64_t agg = 0;
-
-public:
-  StopwatchBase(TimerType &timer) : timer(timer), timer_func{} { restart(); }
-  void pause() { agg += timer_func() - st; }
-  void resume() { st = timer_func(); }
-  void restart() { resume(); }
-  void stop() {
-    pause();
-    timer.add(agg);
-    agg = 0;
+/** the tsc functions below read the platform's timestamp counter
+ * `rdtsc` on x86, `cntvct_el0` on ARM64 and `CLOCK_MONOTONIC` elsewhere.
+ */
+struct RdtscTimerFunc {
+  uint64_t operator()() {
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t a, d;
+    asm volatile("rdtsc" : "=a"(a), "=d"(d));
+    return a | (d << 32);
+#elif defined(__aarch64__)
+    return CntvctTimerFunc{}();
+#else
+    return MonotonicTimerFunc{}();
+#endif
   }
 };
 
-class NoopStopwatch {
-public:
-  NoopStopwatch(TimerType &timer) {}
-  void pause() {}
-  void resume() {}
-  void restart() {}
-  void stop() {}
-};
-
-#ifdef NO_STAT
-using Stopwatch = NoopStopwatch;
-#else
-#ifdef USE_RDTSCP
-using Stopwatch = StopwatchBase<RdtscpTimerFunc>;
+struct RdtscpTimerFunc {
+  uint64_t operator()() {
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t a, d;
+    asm volatile("rdtscp" : "=a"(a), "=d"(d) : : "ecx");
+    return a | (d << 32);
+#elif defined(__aarch64__)
+    return CntvctTimerFunc{}.fenced();
 #else
-using Stopwatch = StopwatchBase<RdtscTimerFunc>;
+    return MonotonicTimerFunc{}();
 #endif
+  }
+  // also return `IA32_TSC_AUX`, see `tsc_aux_cpu`; elsewhere the cpu, on node 0
+  uint64_t operator()(uint32_t &aux) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t a, d;
+    asm volatile("rdtscp" : "=a"(a), "=d"(d), "=c"(aux));
+    return a | (d << 32);
+#else
+    aux = current_cpu();
+    return operator()();
 #endif
-
-class ScopedTimer {
-  Stopwatch sw;
-
-public:
-  ScopedTimer(TimerType &timer) : sw(timer) {}
-  ~ScopedTimer() { sw.stop(); }
+  }
+};
+
+// Linux stores the cpu number in the low 12 bits of `IA32_TSC_AUX` and the node number above
+constexpr uint32_t tsc_aux_cpu(uint32_t aux) { return aux & 0xfff; }
+constexpr uint32_t tsc_aux_node(uint32_t aux) { return aux >> 12; }
+
+/** tsc reads fenced as recommended by Intel for benchmarking short regions
+ * Provides distinct `start()` and `stop()` readers, which `StopwatchBase` prefers over
+ * `operator()`: the region is measured with neither earlier nor later instructions overlapping it.
+ */
+struct FencedTscTimerFunc {
+  // lfence;rdtsc;lfence: wait for earlier instructions, keep the region from starting early
+  uint64_t start() {
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t a, d;
+    asm volatile("lfence\n\trdtsc\n\tlfence" : "=a"(a), "=d"(d)::"memory");
+    return a | (d << 32);
+#elif defined(__aarch64__)
+    auto ret = CntvctTimerFunc{}.fenced();
+    asm volatile("isb" ::: "memory");
+    return ret;
+#else
+    return MonotonicTimerFunc{}();
+#endif
+  }
+  // rdtscp;lfence: wait for the region to finish, keep later instructions from starting early
+  uint64_t stop() {
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t a, d;
+    asm volatile("rdtscp\n\tlfence" : "=a"(a), "=d"(d) : : "ecx", "memory");
+    return a | (d << 32);
+#else
+    return start();
+#endif
+  }
+  uint64_t operator()() { return start(); }
+};
+
+/** whether the tsc is a reliable clock: invariant and not trapped by a hypervisor
+ * Invariant means it ticks at a constant rate whatever the frequency and sleep states of the
+ * core, as reported by CPUID 0x80000007 (EDX bit 8). Some hypervisors trap or emulate `rdtsc`,
+ * which turns a ~25 cycle read into microseconds, so a few reads are also timed. Checked once.
+ */
+inline bool tsc_reliable() {
+  static const bool ret = [] {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned a, b, c, d;
+    if (__get_cpuid_max(0x80000000, nullptr) < 0x80000007) {
+      return false;
+    }
+    __cpuid(0x80000007, a, b, c, d);
+    if (!(d & (1u << 8))) {
+      spdlog::info("tsc isn't invariant");
+      return false;
+    }
+    constexpr int kReads = 100;
+    constexpr double kTrappedNanos = 200;
+    auto start = MonotonicTimerFunc{}();
+    for (int i = 0; i < kReads; i++) {
+      RdtscTimerFunc{}();
+    }
+    double per_read = double(MonotonicTimerFunc{}() - start) / kReads;
+    if (per_read > kTrappedNanos) {
+      spdlog::info("tsc reads take {:.0f}ns, likely trapped", per_read);
+      return false;
+    }
+    return true;
+#elif defined(__aarch64__)
+    // the generic timer always runs at a constant rate
+    return true;
+#else
+    return false;
+#endif
+  }();
+  return ret;
+}
+
+/** the tsc if it's reliable (see `tsc_reliable`), `CLOCK_MONOTONIC` otherwise
+ * The choice is made once, a read costs one more predictable branch. See `HWSTAT_CLOCK_AUTO`.
+ */
+struct AutoTimerFunc {
+  uint64_t operator()() {
+    return tsc_reliable() ? RdtscTimerFunc{}() : MonotonicTimerFunc{}();
+  }
+};
+
+template <typename TimerFunc, typename = void>
+struct HasStartStop : std::false_type {};
+
+template <typename TimerFunc>
+struct HasStartStop<TimerFunc, std::void_t<decltype(std::declval<TimerFunc &>().start()),
+                                           decltype(std::declval<TimerFunc &>().stop())>>
+    : std::true_type {};
+
+#if defined(HWSTAT_CLOCK_MONOTONIC)
+using DefaultTimerFunc = MonotonicTimerFunc;
+#elif defined(HWSTAT_CLOCK_COARSE)
+using DefaultTimerFunc = CoarseTimerFunc;
+#elif defined(HWSTAT_CLOCK_AUTO)
+using DefaultTimerFunc = AutoTimerFunc;
+#elif defined(USE_RDTSCP)
+using DefaultTimerFunc = RdtscpTimerFunc;
+#else
+using DefaultTimerFunc = RdtscTimerFunc;
+#endif
+
+/** reads that keep the cpu (and node) of a measured region, used by per-CPU timers
+ * The region is attributed to where its first segment started. The cpu is compared at every start
+ * & stop, so a migration while paused counts as well. With the tsc as clock each read is a single
+ * `rdtscp`, otherwise the cpu is asked from the kernel and the node isn't known.
+ */
+struct CpuTscTimerFunc {
+  // `IA32_TSC_AUX` of the first start, kept across pause & resume
+  uint32_t start_aux = 0;
+  // of the latest read
+  uint32_t last_aux = 0;
+  bool migrated = false;
+  // between the first start of a region and `finish`
+  bool open = false;
+
+  uint64_t start() {
+    uint32_t aux;
+    auto ret = read(aux);
+    if (!open) {
+      start_aux = aux;
+      migrated = false;
+      open = true;
+    } else {
+      migrated |= aux != last_aux;
+    }
+    last_aux = aux;
+    return ret;
+  }
+  uint64_t stop() {
+    uint32_t aux;
+    auto ret = read(aux);
+    migrated |= aux != last_aux;
+    last_aux = aux;
+    return ret;
+  }
+  // the region was recorded, the next start begins another one
+  void finish() { open = false; }
+  uint64_t operator()() { return start(); }
+
+private:
+#if defined(HWSTAT_CLOCK_MONOTONIC) || defined(HWSTAT_CLOCK_COARSE) || defined(HWSTAT_CLOCK_AUTO)
+  static uint64_t read(uint32_t &aux) {
+    aux = current_cpu();
+    return DefaultTimerFunc{}();
+  }
+#else
+  static uint64_t read(uint32_t &aux) { return RdtscpTimerFunc{}(aux); }
+#endif
+};
+
+/** hardware events that can be counted through the PMU */
+enum class PmuEvent { Cycles, Instructions, CacheMisses, BranchMisses, LLCLoads, L1DMisses };
+constexpr size_t kPmuEvents = 6;
+
+constexpr const char *pmu_event_name(PmuEvent e) {
+  constexpr const char *names[] = {"cycles",        "instructions", "cache-misses",
+                                   "branch-misses", "llc-loads",    "l1d-misses"};
+  return names[size_t(e)];
+}
+
+/** the PMU events of one thread
+ * Each event is programmed on first `open` with `perf_event_open` for the calling thread only (user
+ * space, all CPUs) and read with `rdpmc` through the mmap'd control page, so no syscall is needed
+ * on the hot path. Only opened events occupy a hardware counter. If the kernel doesn't allow
+ * `rdpmc` the counter falls back to `read(2)`, and if the event can't be opened it reads as 0.
+ * When the kernel multiplexes more events than there are counters, an event only counts while it's
+ * scheduled, so its count is scaled by the time it was enabled over the time it was running.
+ */
+class PerfEvents {
+#ifdef __linux__
+  struct Event {
+    bool opened = false;
+    int fd = -1;
+    perf_event_mmap_page *page = nullptr;
+  };
+  Event events[kPmuEvents];
+
+  static void setup(perf_event_attr &attr, PmuEvent e) {
+    attr.type = PERF_TYPE_HARDWARE;
+    switch (e) {
+    case PmuEvent::Cycles:
+      attr.config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case PmuEvent::Instructions:
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case PmuEvent::CacheMisses:
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      break;
+    case PmuEvent::BranchMisses:
+      attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+      break;
+    case PmuEvent::LLCLoads:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                    (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16);
+      break;
+    case PmuEvent::L1DMisses:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      break;
+    }
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  static constexpr bool kUserPmc = true;
+  static uint64_t rdpmc(uint32_t counter) {
+    uint32_t a, d;
+    asm volatile("rdpmc" : "=a"(a), "=d"(d) : "c"(counter));
+    return a | (uint64_t(d) << 32);
+  }
+#else
+  // counters are only read from user space on x86, elsewhere through `read`
+  static constexpr bool kUserPmc = false;
+  static uint64_t rdpmc(uint32_t counter) { return 0; }
+#endif
+
+  static uint64_t scale(uint64_t count, uint64_t enabled, uint64_t running) {
+    if (enabled == running) {
+      return count;
+    }
+    return running ? uint64_t(double(count) * enabled / running) : 0;
+  }
+
+public:
+  PerfEvents() = default;
+  ~PerfEvents() {
+    for (auto &e : events) {
+      if (e.page) {
+        munmap(e.page, sysconf(_SC_PAGESIZE));
+      }
+      if (e.fd >= 0) {
+        close(e.fd);
+      }
+    }
+  }
+  PerfEvents(const PerfEvents &) = delete;
+  PerfEvents(PerfEvents &&) = delete;
+
+  void open(PmuEvent e) {
+    auto &ev = events[size_t(e)];
+    if (ev.opened) {
+      return;
+    }
+    ev.opened = true;
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    setup(attr, e);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    ev.fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (ev.fd < 0) {
+      static std::once_flag warned;
+      std::call_once(warned, [] { spdlog::warn("perf events unavailable, PMU stats read as 0"); });
+      return;
+    }
+    void *page = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, ev.fd, 0);
+    ev.page = page == MAP_FAILED ? nullptr : static_cast<perf_event_mmap_page *>(page);
+  }
+
+  uint64_t read(PmuEvent e) const {
+    auto &ev = events[size_t(e)];
+    if (volatile perf_event_mmap_page *pc = ev.page) {
+      // the kernel updates the control page under a sequence lock
+      uint32_t seq, idx;
+      int64_t count;
+      uint64_t enabled, running;
+      do {
+        seq = pc->lock;
+        std::atomic_signal_fence(std::memory_order_acquire);
+        idx = pc->index;
+        count = pc->offset;
+        enabled = pc->time_enabled;
+        running = pc->time_running;
+        if (kUserPmc && pc->cap_user_time && enabled != running) {
+          // the times were updated when the event was last scheduled, add the time since then
+          uint64_t cyc = RdtscTimerFunc{}(), shift = pc->time_shift, mult = pc->time_mult;
+          uint64_t rem = cyc & ((uint64_t(1) << shift) - 1);
+          uint64_t delta = pc->time_offset + (cyc >> shift) * mult + ((rem * mult) >> shift);
+          enabled += delta;
+          running += idx ? delta : 0;
+        }
+        if (kUserPmc && pc->cap_user_rdpmc && idx) {
+          auto width = pc->pmc_width;
+          auto pmc = int64_t(rdpmc(idx - 1) << (64 - width)) >> (64 - width);
+          count += pmc;
+        }
+        std::atomic_signal_fence(std::memory_order_acquire);
+      } while (pc->lock != seq);
+      if (kUserPmc && pc->cap_user_rdpmc && idx) {
+        return scale(count, enabled, running);
+      }
+    }
+    // value, time enabled & time running
+    uint64_t value[3] = {};
+    if (ev.fd >= 0 && ::read(ev.fd, value, sizeof(value)) != sizeof(value)) {
+      return 0;
+    }
+    return scale(value[0], value[1], value[2]);
+  }
+#else
+public:
+  void open(PmuEvent e) {}
+  uint64_t read(PmuEvent e) const { return 0; }
+#endif
+
+  // the events of the calling thread
+  static PerfEvents &local() {
+    static thread_local PerfEvents events;
+    return events;
+  }
+};
+
+/** timer function reading a PMU event of the calling thread instead of the tsc */
+template <PmuEvent E>
+struct PmuTimerFunc {
+  const PerfEvents &events = open();
+  uint64_t operator()() { return events.read(E); }
+  static const PerfEvents &open() {
+    auto &ret = PerfEvents::local();
+    ret.open(E);
+    return ret;
+  }
+};
+
+static inline void lfence() {
+#if defined(__x86_64__) || defined(__i386__)
+  asm volatile("lfence" ::: "memory");
+#elif defined(__aarch64__)
+  asm volatile("isb" ::: "memory");
+#else
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+#endif
+}
+
+/** metric sources of a `MULTI_TIMER` */
+struct TscSource {
+  static constexpr const char *kName = "tsc";
+  static void open(PerfEvents &perf) {}
+  // in ticks of the default clock, which is the tsc unless `HWSTAT_CLOCK_*` picks another
+  static uint64_t read(const PerfEvents &perf) { return DefaultTimerFunc{}(); }
+};
+
+template <PmuEvent E>
+struct PmuSource {
+  static constexpr const char *kName = pmu_event_name(E);
+  static void open(PerfEvents &perf) { perf.open(E); }
+  static uint64_t read(const PerfEvents &perf) { return perf.read(E); }
+};
+
+namespace metric {
+using Tsc = TscSource;
+using Cycles = PmuSource<PmuEvent::Cycles>;
+using Instructions = PmuSource<PmuEvent::Instructions>;
+using CacheMisses = PmuSource<PmuEvent::CacheMisses>;
+using BranchMisses = PmuSource<PmuEvent::BranchMisses>;
+using LLCLoads = PmuSource<PmuEvent::LLCLoads>;
+using L1DMisses = PmuSource<PmuEvent::L1DMisses>;
+} // namespace metric
+
+static inline double measure_tsc_ghz(int sleep_ms = 10) {
+  auto timer_func = RdtscTimerFunc{};
+  auto start_clk = std::chrono::high_resolution_clock::now();
+  unsigned long start = timer_func();
+  std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
+  auto end_clk = std::chrono::high_resolution_clock::now();
+  unsigned long end = timer_func();
+  auto count_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end_clk - start_clk).count();
+  auto ret = double(end - start) / count_ns;
+  spdlog::info("measured tsc frequency as {:.3}Ghz", ret);
+  return ret;
+}
+
+/** nominal tsc frequency reported by CPUID, 0 if unknown */
+static inline double cpuid_tsc_ghz() {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned a, b, c, d;
+  // leaf 0x15: tsc/crystal ratio in ebx/eax, crystal frequency in ecx
+  if (__get_cpuid_max(0, nullptr) >= 0x15) {
+    __cpuid(0x15, a, b, c, d);
+    if (a && b && c) {
+      return double(c) * b / a / 1e9;
+    }
+  }
+  // hypervisors report the guest tsc frequency in kHz at leaf 0x40000010
+  __cpuid(1, a, b, c, d);
+  if (c & (1u << 31)) {
+    __cpuid(0x40000000, a, b, c, d);
+    if (a >= 0x40000010) {
+      __cpuid(0x40000010, a, b, c, d);
+      if (a) {
+        return a / 1e6;
+      }
+    }
+  }
+  // leaf 0x16: base frequency in MHz, which the invariant tsc runs at
+  if (__get_cpuid_max(0, nullptr) >= 0x16) {
+    __cpuid(0x16, a, b, c, d);
+    if (a & 0xffff) {
+      return (a & 0xffff) / 1e3;
+    }
+  }
+#endif
+  return 0.0;
+}
+
+/** tsc frequency the kernel uses to convert tsc to time, 0 if unknown */
+static inline double perf_tsc_ghz() {
+#ifdef __linux__
+  perf_event_attr attr{};
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.config = PERF_COUNT_SW_DUMMY;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd < 0) {
+    return 0.0;
+  }
+  double ret = 0.0;
+  auto page_size = sysconf(_SC_PAGESIZE);
+  void *page = mmap(nullptr, page_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (page != MAP_FAILED) {
+    // ns = cycles * time_mult >> time_shift
+    auto *pc = static_cast<volatile perf_event_mmap_page *>(page);
+    if (pc->cap_user_time && pc->time_mult) {
+      ret = double(uint64_t(1) << pc->time_shift) / pc->time_mult;
+    }
+    munmap(page, page_size);
+  }
+  close(fd);
+  return ret;
+#else
+  return 0.0;
+#endif
+}
+
+/** tsc frequency from the first source that knows it, see `TSC_FREQ_GHZ` */
+static inline double detect_tsc_ghz() {
+#ifdef NO_STAT
+  return 0.0;
+#elif defined(TSC_FREQ_GHZ)
+  spdlog::info("predefined tsc frequency as {:.3}Ghz", TSC_FREQ_GHZ);
+  return TSC_FREQ_GHZ;
+#else
+  if (const char *env = std::getenv("HWSTAT_TSC_GHZ")) {
+    if (double ret = std::atof(env); ret > 0) {
+      spdlog::info("tsc frequency from HWSTAT_TSC_GHZ as {:.3}Ghz", ret);
+      return ret;
+    }
+  }
+#if defined(__aarch64__)
+  double ret = CntvctTimerFunc::freqGhz();
+  spdlog::info("counter frequency from cntfrq_el0 as {:.3}Ghz", ret);
+  return ret;
+#elif !defined(__x86_64__) && !defined(__i386__)
+  // the "tsc" is CLOCK_MONOTONIC
+  return 1.0;
+#endif
+  if (double ret = perf_tsc_ghz(); ret > 0) {
+    spdlog::info("tsc frequency from kernel as {:.3}Ghz", ret);
+    return ret;
+  }
+  if (double ret = cpuid_tsc_ghz(); ret > 0) {
+    spdlog::info("tsc frequency from cpuid as {:.3}Ghz", ret);
+    return ret;
+  }
+  return measure_tsc_ghz();
+#endif
+}
+
+/** ticks per nanosecond of `DefaultTimerFunc`, see `HWSTAT_CLOCK_MONOTONIC` */
+static inline double detect_clock_ghz() {
+#if defined(NO_STAT)
+  return 0.0;
+#elif defined(HWSTAT_CLOCK_MONOTONIC) || defined(HWSTAT_CLOCK_COARSE)
+  return 1.0;
+#elif defined(HWSTAT_CLOCK_AUTO)
+  if (!tsc_reliable()) {
+    spdlog::info("timing with CLOCK_MONOTONIC instead of the tsc");
+    return 1.0;
+  }
+  return detect_tsc_ghz();
+#else
+  return detect_tsc_ghz();
+#endif
+}
+
+struct TimerAgg {
+  uint64_t cnt = 0;
+  uint64_t cycles = 0;
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+  // before the overhead was subtracted
+  uint64_t raw_cycles = 0;
+#endif
+  // of the default clock (1 for nanosecond clocks), detected on first use and shared by all
+  // translation units
+  static double freqGhz() {
+    static const double freq = detect_clock_ghz();
+    return freq;
+  }
+  // cost of an empty start/stop of a stopwatch using `TimerFunc`, 0 until calibrated
+  template <typename TimerFunc>
+  static inline std::atomic<uint64_t> kOverheadCycles{0};
+  template <typename TimerFunc>
+  static inline std::atomic<bool> kOverheadCalibrated{false};
+  double getNanos() const { return cycles / freqGhz(); }
+  // cycles with the measurement overhead, see `HWSTAT_SUBTRACT_OVERHEAD`
+  uint64_t getRawCycles() const {
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+    return raw_cycles;
+#else
+    return cycles;
+#endif
+  }
+  uint64_t getAvgCycles() const { return cycles / cnt; }
+  double getAvgNanos() const { return getNanos() / cnt; }
+  static double cyclesToSeconds(uint64_t cycles) { return cycles / freqGhz() / 1e9; }
+};
+
+/** timer storage policies
+ * A policy holds the per-thread slots of a timer: `record` runs on the owning thread for every
+ * sample and `merge` folds the slots into the policy's `AggregateType`.
+ */
+struct TimerCounts {
+  using AggregateType = TimerAgg;
+  Slot cycles;
+  Slot cnt;
+  // `n` samples that took `dc` cycles in total, see `LocalTimer`
+  void record(uint64_t dc = 0, uint64_t n = 1) {
+    cycles.add(dc);
+    cnt.add(n);
+  }
+  void merge(TimerAgg &agg) const {
+    agg.cnt += cnt.load();
+    agg.cycles += cycles.load();
+  }
+};
+
+struct MomentsAgg : TimerAgg {
+  uint64_t min = UINT64_MAX;
+  uint64_t max = 0;
+  // mean of the samples and the sum of their squared deviations from it (Welford), which don't
+  // lose precision to cancellation as a sum of squares does
+  double mean = 0;
+  double m2 = 0;
+  double getStddevCycles() const { return cnt < 2 ? 0 : std::sqrt(std::max(0.0, m2 / (cnt - 1))); }
+  double getStddevNanos() const { return getStddevCycles() / freqGhz(); }
+  // fold in the moments of `n` other samples (Chan et al.), before `cnt` counts them
+  void addMoments(uint64_t n, double other_mean, double other_m2) {
+    if (n == 0) {
+      return;
+    }
+    double na = cnt, nb = n, total = na + nb;
+    double delta = other_mean - mean;
+    mean += delta * nb / total;
+    m2 += other_m2 + delta * delta * na * nb / total;
+  }
+};
+
+struct TimerMoments : TimerCounts {
+  using AggregateType = MomentsAgg;
+  Slot min{UINT64_MAX};
+  Slot max;
+  BasicSlot<double> mean;
+  BasicSlot<double> m2;
+  void record(uint64_t dc) {
+    TimerCounts::record(dc);
+    min.store(std::min(min.load(), dc));
+    max.store(std::max(max.load(), dc));
+    double x = dc, prev = mean.load();
+    double next = prev + (x - prev) / cnt.load();
+    mean.store(next);
+    m2.store(m2.load() + (x - prev) * (x - next));
+  }
+  void merge(MomentsAgg &agg) const {
+    agg.addMoments(cnt.load(), mean.load(), m2.load());
+    TimerCounts::merge(agg);
+    agg.min = std::min(agg.min, min.load());
+    agg.max = std::max(agg.max, max.load());
+  }
+};
+
+struct SampledAgg : TimerAgg {
+  // entries that were timed, `cycles` only covers these while `cnt` counts every entry
+  uint64_t samples = 0;
+  // extrapolated to all entries
+  double getCycles() const { return samples == 0 ? 0 : double(cycles) * cnt / samples; }
+  double getNanos() const { return getCycles() / freqGhz(); }
+  uint64_t getAvgCycles() const { return cycles / samples; }
+  double getAvgNanos() const { return double(cycles) / samples / freqGhz(); }
+};
+
+/** storage of a timer that only times 1 in `rate` entries
+ * `begin` runs when a stopwatch starts and counts down on the owning thread, so skipped entries
+ * cost a counter update and no clock read.
+ */
+struct TimerSampled {
+  using AggregateType = SampledAgg;
+  Slot cnt;
+  Slot samples;
+  Slot cycles;
+  // owning thread only
+  uint32_t rate;
+  uint32_t countdown;
+  TimerSampled(uint32_t rate) : rate(std::max(rate, 1u)), countdown(this->rate) {}
+  bool begin() {
+    if (--countdown) {
+      cnt.add(1);
+      return false;
+    }
+    countdown = rate;
+    return true;
+  }
+  void record(uint64_t dc) {
+    cnt.add(1);
+    samples.add(1);
+    cycles.add(dc);
+  }
+  void merge(SampledAgg &agg) const {
+    agg.cnt += cnt.load();
+    agg.samples += samples.load();
+    agg.cycles += cycles.load();
+  }
+};
+
+#ifdef HWSTAT_MAX_CPUS
+constexpr size_t kMaxCpus = HWSTAT_MAX_CPUS;
+#else
+constexpr size_t kMaxCpus = 256;
+#endif
+#ifdef HWSTAT_MAX_NODES
+constexpr size_t kMaxNodes = HWSTAT_MAX_NODES;
+#else
+constexpr size_t kMaxNodes = 8;
+#endif
+
+struct CpuAgg : TimerAgg {
+  // regions that stopped on another CPU than they started on
+  uint64_t migrations = 0;
+  // by the CPU & node a region started on
+  std::array<TimerAgg, kMaxCpus> cpus{};
+  std::array<TimerAgg, kMaxNodes> nodes{};
+  /** call `f("cpu"/"node", id, agg)` for every CPU & node that recorded something
+   * Nodes are left out on single node machines.
+   */
+  template <typename F>
+  void forEachPart(F &&f) const {
+    size_t used = std::count_if(nodes.begin(), nodes.end(), [](auto &n) { return n.cnt != 0; });
+    for (size_t i = 0; used > 1 && i < kMaxNodes; i++) {
+      if (nodes[i].cnt) {
+        f("node", i, nodes[i]);
+      }
+    }
+    for (size_t i = 0; i < kMaxCpus; i++) {
+      if (cpus[i].cnt) {
+        f("cpu", i, cpus[i]);
+      }
+    }
+  }
+};
+
+/** storage of a timer that breaks its samples down by CPU & NUMA node
+ * Stopwatches of such a timer read the clock with `CpuTscTimerFunc`, so every sample comes with the
+ * `IA32_TSC_AUX` of its start and whether it migrated. Counters have no such breakdown: telling
+ * the cpu would cost an `rdtscp` per increment.
+ */
+struct TimerPerCpu : TimerCounts {
+  using AggregateType = CpuAgg;
+  static constexpr bool kPerCpu = true;
+  struct Part {
+    Slot cycles;
+    Slot cnt;
+  };
+  Slot migrations;
+  Part cpus[kMaxCpus];
+  Part nodes[kMaxNodes];
+  void record(uint64_t dc, uint32_t start_aux, bool migrated) {
+    TimerCounts::record(dc);
+    if (migrated) {
+      migrations.add(1);
+    }
+    auto cpu = tsc_aux_cpu(start_aux);
+    auto node = tsc_aux_node(start_aux);
+    if (cpu < kMaxCpus) {
+      cpus[cpu].cycles.add(dc);
+      cpus[cpu].cnt.add(1);
+    }
+    if (node < kMaxNodes) {
+      nodes[node].cycles.add(dc);
+      nodes[node].cnt.add(1);
+    }
+  }
+  void merge(CpuAgg &agg) const {
+    TimerCounts::merge(agg);
+    agg.migrations += migrations.load();
+    for (size_t i = 0; i < kMaxCpus; i++) {
+      agg.cpus[i].cycles += cpus[i].cycles.load();
+      agg.cpus[i].cnt += cpus[i].cnt.load();
+    }
+    for (size_t i = 0; i < kMaxNodes; i++) {
+      agg.nodes[i].cycles += nodes[i].cycles.load();
+      agg.nodes[i].cnt += nodes[i].cnt.load();
+    }
+  }
+};
+
+template <typename Timer, typename = void>
+struct IsPerCpu : std::false_type {};
+
+template <typename Timer>
+struct IsPerCpu<Timer, std::void_t<decltype(Timer::kPerCpu)>> : std::true_type {};
+
+/** log-linear histogram layout
+ * Every power of two is split into 2^kSubBits linear buckets (values below 2^(kSubBits + 1) get one
+ * bucket each), so a recorded value is off by at most 1/2^kSubBits (6.25%). Values of 2^kMaxBits
+ * cycles or more all land in the last bucket.
+ */
+struct HistLayout {
+  static constexpr int kSubBits = 4;
+  static constexpr int kMaxBits = 40;
+  static constexpr uint64_t kMaxValue = (1ULL << kMaxBits) - 1;
+  static constexpr size_t kBuckets = size_t(kMaxBits - kSubBits + 1) << kSubBits;
+  static size_t index(uint64_t v) {
+    v = std::min(v, kMaxValue);
+    // the `| 1 << kSubBits` keeps the lzcnt operand non-zero and the small values linear
+    int msb = 63 - __builtin_clzll(v | (1ULL << kSubBits));
+    int shift = msb - kSubBits;
+    return (size_t(shift) << kSubBits) + (v >> shift);
+  }
+  // the largest value that maps to bucket `idx`
+  static uint64_t upperBound(size_t idx) {
+    if (idx < (2UL << kSubBits)) {
+      return idx;
+    }
+    int shift = int(idx >> kSubBits) - 1;
+    uint64_t mantissa = (idx & ((1UL << kSubBits) - 1)) | (1UL << kSubBits);
+    return (mantissa << shift) + (1ULL << shift) - 1;
+  }
+};
+
+struct HistAgg : TimerAgg {
+  uint64_t max = 0;
+  std::array<uint64_t, HistLayout::kBuckets> buckets{};
+  // the value below which fraction `q` of the samples fall, accurate to the bucket width
+  uint64_t getPercentileCycles(double q) const {
+    uint64_t total = 0;
+    for (auto b : buckets) {
+      total += b;
+    }
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, uint64_t(q * total + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+      seen += buckets[i];
+      if (seen >= rank) {
+        return std::min(HistLayout::upperBound(i), max);
+      }
+    }
+    return max;
+  }
+  double getPercentileNanos(double q) const { return getPercentileCycles(q) / freqGhz(); }
+};
+
+struct TimerHistogram : TimerCounts {
+  using AggregateType = HistAgg;
+  Slot max;
+  Slot buckets[HistLayout::kBuckets];
+  void record(uint64_t dc) {
+    TimerCounts::record(dc);
+    max.store(std::max(max.load(), dc));
+    buckets[HistLayout::index(dc)].add(1);
+  }
+  void merge(HistAgg &agg) const {
+    TimerCounts::merge(agg);
+    agg.max = std::max(agg.max, max.load());
+    for (size_t i = 0; i < HistLayout::kBuckets; i++) {
+      agg.buckets[i] += buckets[i].load();
+    }
+  }
+};
+
+constexpr size_t kMaxMetrics = 8;
+
+struct MetricsAgg {
+  uint64_t cnt = 0;
+  size_t n = 0;
+  const char *const *names = nullptr;
+  std::array<uint64_t, kMaxMetrics> values{};
+  // index of the metric called `name`, or -1
+  int find(const char *name) const {
+    for (size_t i = 0; i < n; i++) {
+      if (strcmp(names[i], name) == 0) {
+        return i;
+      }
+    }
+    return -1;
+  }
+  double getPerCall(size_t i) const { return cnt == 0 ? 0 : double(values[i]) / cnt; }
+  // instructions per core cycle, 0 unless both are recorded
+  double getIpc() const {
+    int c = find(metric::Cycles::kName), i = find(metric::Instructions::kName);
+    return c < 0 || i < 0 || values[c] == 0 ? 0 : double(values[i]) / values[c];
+  }
+};
+
+/** storage of a timer recording several metrics for each sample, one slot per source */
+template <typename... Sources>
+struct TimerMetrics {
+  static constexpr size_t kMetrics = sizeof...(Sources);
+  static_assert(kMetrics > 0 && kMetrics <= kMaxMetrics, "unsupported number of metrics");
+  static constexpr const char *kNames[] = {Sources::kName...};
+  using AggregateType = MetricsAgg;
+  Slot cnt;
+  Slot values[kMetrics];
+  // PMU events are programmed when the thread registers the timer
+  const PerfEvents *perf = &open();
+  void record(const uint64_t *d) {
+    cnt.add(1);
+    for (size_t i = 0; i < kMetrics; i++) {
+      values[i].add(d[i]);
+    }
+  }
+  void merge(MetricsAgg &agg) const {
+    agg.n = kMetrics;
+    agg.names = kNames;
+    agg.cnt += cnt.load();
+    for (size_t i = 0; i < kMetrics; i++) {
+      agg.values[i] += values[i].load();
+    }
+  }
+  static const PerfEvents &open() {
+    auto &perf = PerfEvents::local();
+    (Sources::open(perf), ...);
+    return perf;
+  }
+};
+
+template <typename Policy, typename = void>
+struct HasBegin : std::false_type {};
+
+template <typename Policy>
+struct HasBegin<Policy, std::void_t<decltype(std::declval<Policy &>().begin())>> : std::true_type {
+};
+
+// the kernel's id of the calling thread
+inline uint32_t current_tid() {
+#ifdef __linux__
+  return syscall(SYS_gettid);
+#else
+  return std::hash<std::thread::id>{}(std::this_thread::get_id());
+#endif
+}
+
+#ifdef HWSTAT_EXITED_THREADS
+constexpr size_t kExitedThreads = HWSTAT_EXITED_THREADS;
+#else
+constexpr size_t kExitedThreads = 64;
+#endif
+
+template <typename V>
+struct StatEntry {
+  const char *name;
+  const char *desc;
+  V value;
+};
+
+/** the timers & counters of one thread, see `HWSTAT_THREAD_STATS` */
+struct ThreadStats {
+  // unique for the lifetime of the process, unlike tids
+  uint64_t serial = 0;
+  uint32_t tid = 0;
+  std::string name;
+  bool exited = false;
+  std::vector<StatEntry<TimerAgg>> timers;
+  std::vector<StatEntry<uint64_t>> counters;
+};
+
+/** identity of a thread that registered stats */
+struct ThreadInfo {
+  uint64_t serial;
+  uint32_t tid;
+  char name[16];
+  // instances that haven't retired yet, owning thread only
+  mutable uint32_t instances = 0;
+
+  // the calling thread's, valid until it exits
+  static const ThreadInfo *current() {
+    static std::atomic<uint64_t> next{1};
+    // trivially destructible, so it outlives every thread_local stat of the thread
+    static thread_local ThreadInfo info = [] {
+      ThreadInfo ret{next.fetch_add(1), current_tid(), {}, 0};
+      capture_name(ret.name);
+      return ret;
+    }();
+    return &info;
+  }
+  static void capture_name(char (&name)[16]) {
+#ifdef __linux__
+    if (pthread_getname_np(pthread_self(), name, sizeof(name)) != 0) {
+      name[0] = '\0';
+    }
+#endif
+  }
+};
+
+/** values of exited threads, the most recent `kExitedThreads` of them
+ * An instance leaves its global stat and enters the history under the same lock that readers take,
+ * so they see its value exactly once, either live or exited.
+ */
+class ThreadHistory {
+  std::mutex mtx;
+  std::vector<ThreadStats> exited;
+  // of threads that have instances left to retire, which are kept until they're done
+  std::vector<uint64_t> retiring;
+
+  ThreadStats &find(const ThreadInfo &info) {
+    // threads exiting at the same time retire their instances interleaved
+    auto it = std::find_if(exited.rbegin(), exited.rend(),
+                           [&](const ThreadStats &t) { return t.serial == info.serial; });
+    if (it != exited.rend()) {
+      return *it;
+    }
+    if (exited.size() >= kExitedThreads) {
+      auto oldest = std::find_if(exited.begin(), exited.end(), [&](const ThreadStats &t) {
+        return std::find(retiring.begin(), retiring.end(), t.serial) == retiring.end();
+      });
+      if (oldest != exited.end()) {
+        exited.erase(oldest);
+      }
+    }
+    ThreadStats t;
+    t.serial = info.serial;
+    t.tid = info.tid;
+    // the thread may have been named after its first stat, look again
+    char name[16];
+    ThreadInfo::capture_name(name);
+    t.name = name[0] ? name : info.name;
+    t.exited = true;
+    exited.push_back(std::move(t));
+    return exited.back();
+  }
+
+public:
+  static ThreadHistory &get() {
+    static ThreadHistory h;
+    return h;
+  }
+  // called on the exiting thread by each of its instances, with `dereg` folding the instance into
+  // its global stat and returning its value
+  template <typename F>
+  void retire(const ThreadInfo &info, const char *name, const char *desc, F &&dereg) {
+    std::lock_guard<std::mutex> guard(mtx);
+    auto value = dereg();
+    auto &t = find(info);
+    if constexpr (std::is_same_v<decltype(value), TimerAgg>) {
+      t.timers.push_back({name, desc, value});
+    } else {
+      t.counters.push_back({name, desc, value});
+    }
+    auto it = std::find(retiring.begin(), retiring.end(), info.serial);
+    if (--info.instances == 0) {
+      if (it != retiring.end()) {
+        retiring.erase(it);
+      }
+    } else if (it == retiring.end()) {
+      retiring.push_back(info.serial);
+    }
+  }
+  // `f(exited)` runs under the lock, so no instance retires meanwhile
+  template <typename F>
+  void visit(F &&f) {
+    std::lock_guard<std::mutex> guard(mtx);
+    f(std::as_const(exited));
+  }
+};
+
+template <typename Policy = TimerCounts>
+struct _HWSTAT_SLOT_ALIGN PerThreadTimerT : Policy {
+  using GlobalTimer = GlobalStat<PerThreadTimerT>;
+  using AggregateType = typename Policy::AggregateType;
+  GlobalTimer *global_timer;
+  std::atomic<PerThreadTimerT *> reg_next{nullptr};
+#ifdef HWSTAT_THREAD_STATS
+  // only plain timers are broken down by thread
+  static constexpr bool kThreadStats = std::is_same_v<Policy, TimerCounts>;
+  const ThreadInfo *thread = ThreadInfo::current();
+#endif
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+  Slot raw_cycles;
+#endif
+  template <typename... Args>
+  PerThreadTimerT(GlobalTimer *globalTimer, Args... args)
+      : Policy(args...), global_timer(globalTimer) {
+#ifdef HWSTAT_THREAD_STATS
+    if constexpr (kThreadStats) {
+      thread->instances++;
+    }
+#endif
+    globalTimer->reg(this);
+  }
+  PerThreadTimerT(const PerThreadTimerT &) = delete;
+  PerThreadTimerT(PerThreadTimerT &&) = delete;
+  ~PerThreadTimerT() {
+#ifdef HWSTAT_THREAD_STATS
+    if constexpr (kThreadStats) {
+      ThreadHistory::get().retire(*thread, global_timer->name, global_timer->desc, [this] {
+        global_timer->dereg(this);
+        return aggregate(AggregateType{});
+      });
+      return;
+    }
+#endif
+    global_timer->dereg(this);
+  }
+  template <typename... Args>
+  void add(Args... args) {
+    Policy::record(args...);
+  }
+  // unadjusted cycles of the samples added, see `HWSTAT_SUBTRACT_OVERHEAD`
+  void addRaw(uint64_t dc) {
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+    raw_cycles.add(dc);
+#endif
+  }
+  void aggregateInto(AggregateType &agg) {
+    Policy::merge(agg);
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+    if constexpr (std::is_base_of_v<TimerAgg, AggregateType>) {
+      agg.raw_cycles += raw_cycles.load();
+    }
+#endif
+  }
+  AggregateType aggregate(AggregateType prev) {
+    aggregateInto(prev);
+    return prev;
+  }
+  AggregateType stat() { return global_timer->calcStat(); }
+  bool active() const { return global_timer->active(); }
+  const char *name() const { return global_timer->name; }
+  // called when a stopwatch starts, false if it shouldn't read the clock
+  bool begin() {
+    if constexpr (HasBegin<Policy>::value) {
+      return active() && Policy::begin();
+    } else {
+      return active();
+    }
+  }
+};
+
+using PerThreadTimer = PerThreadTimerT<TimerCounts>;
+/** timer that also tracks min, max & standard deviation of its samples */
+using PerThreadMomentsTimer = PerThreadTimerT<TimerMoments>;
+/** timer that also records the distribution of its samples */
+using PerThreadHistTimer = PerThreadTimerT<TimerHistogram>;
+/** timer that only times 1 in N entries and extrapolates the total time */
+using PerThreadSampledTimer = PerThreadTimerT<TimerSampled>;
+/** timer that also breaks its samples down by CPU & NUMA node */
+using PerThreadCpuTimer = PerThreadTimerT<TimerPerCpu>;
+/** timer recording a list of metrics
+ * e.g. `PerThreadMetricsTimer<metric::Tsc, metric::Instructions>`
+ */
+template <typename... Sources>
+using PerThreadMetricsTimer = PerThreadTimerT<TimerMetrics<Sources...>>;
+/** timer that also counts the common PMU events */
+using PerThreadPmuTimer =
+    PerThreadMetricsTimer<metric::Tsc, metric::Cycles, metric::Instructions, metric::CacheMisses,
+                          metric::BranchMisses, metric::LLCLoads>;
+
+/** all multi-metric timers, whatever their list of metrics
+ * Every list is a different `GlobalStat` type, so `MULTI_TIMER` also adds its stat here to be
+ * found by printing and snapshots.
+ */
+class MetricsRegistry {
+  struct Item {
+    const char *desc;
+    void *stat;
+    MetricsAgg (*calc)(void *);
+  };
+  std::mutex mtx;
+  std::map<const char *, Item> items;
+
+public:
+  static MetricsRegistry &get() {
+    static MetricsRegistry r;
+    return r;
+  }
+  template <typename G>
+  void add(G *g) {
+    std::lock_guard<std::mutex> guard(mtx);
+    auto calc = [](void *p) { return static_cast<G *>(p)->calcStat(); };
+    items.emplace(g->name, Item{g->desc, g, calc});
+  }
+  void remove(const char *name) {
+    std::lock_guard<std::mutex> guard(mtx);
+    items.erase(name);
+  }
+  template <typename F>
+  void forEach(F &&f) {
+    std::lock_guard<std::mutex> guard(mtx);
+    for (const auto &kv : items) {
+      f(kv.first, kv.second.desc, kv.second.calc(kv.second.stat));
+    }
+  }
+  // the registered name equal to `name`, null if there's none
+  const char *find(const char *name) {
+    std::lock_guard<std::mutex> guard(mtx);
+    for (const auto &kv : items) {
+      if (strcmp(kv.first, name) == 0) {
+        return kv.first;
+      }
+    }
+    return nullptr;
+  }
+  // aggregated value of the timer registered as `name`, empty if it's gone
+  MetricsAgg calc(const char *name) {
+    std::lock_guard<std::mutex> guard(mtx);
+    auto it = items.find(name);
+    return it == items.end() ? MetricsAgg{} : it->second.calc(it->second.stat);
+  }
+};
+
+/** keeps the multi-metric timer `*g` in `MetricsRegistry` while it's alive */
+template <typename G>
+class MetricsRegistration {
+  G *g;
+
+public:
+  MetricsRegistration(G *g) : g(g) { MetricsRegistry::get().add(g); }
+  ~MetricsRegistration() { MetricsRegistry::get().remove(g->name); }
+  MetricsRegistration(const MetricsRegistration &) = delete;
+  MetricsRegistration(MetricsRegistration &&) = delete;
+};
+
+struct NoopTimer {
+  using GlobalTimer = GlobalStat<NoopTimer>;
+  using AggregateType = TimerAgg;
+  template <typename... Args>
+  constexpr NoopTimer(GlobalTimer *timer, Args... args) {}
+  NoopTimer(const NoopTimer &) = delete;
+  NoopTimer(NoopTimer &&) = delete;
+  void add(uint64_t dc = 0, uint64_t n = 1) {}
+  void addRaw(uint64_t dc) {}
+  AggregateType aggregate(AggregateType prev) { return AggregateType{}; }
+  AggregateType stat() { return AggregateType{}; }
+  constexpr bool active() const { return false; }
+  constexpr bool begin() const { return false; }
+};
+
+struct _HWSTAT_SLOT_ALIGN PerThreadCounter {
+  using GlobalCounter = GlobalStat<PerThreadCounter>;
+  using AggregateType = uint64_t;
+  Slot cnt;
+  GlobalCounter *global_counter;
+  std::atomic<PerThreadCounter *> reg_next{nullptr};
+#ifdef HWSTAT_THREAD_STATS
+  const ThreadInfo *thread = ThreadInfo::current();
+#endif
+  PerThreadCounter(GlobalCounter *globalCounter) : global_counter(globalCounter) {
+#ifdef HWSTAT_THREAD_STATS
+    thread->instances++;
+#endif
+    globalCounter->reg(this);
+  }
+  PerThreadCounter(const PerThreadCounter &) = delete;
+  PerThreadCounter(PerThreadTimer &&) = delete;
+  ~PerThreadCounter() {
+#ifdef HWSTAT_THREAD_STATS
+    ThreadHistory::get().retire(*thread, global_counter->name, global_counter->desc, [this] {
+      global_counter->dereg(this);
+      return cnt.load();
+    });
+#else
+    global_counter->dereg(this);
+#endif
+  }
+  void add(int d = 1) {
+    if (active()) {
+      cnt.add(d);
+    }
+  }
+  uint64_t operator++() { return *this += 1; }
+  uint64_t operator++(int) { return active() ? cnt.add(1) - 1 : cnt.load(); }
+  uint64_t operator+=(uint64_t d) { return active() ? cnt.add(d) : cnt.load(); }
+  AggregateType aggregate(AggregateType prev) { return prev + cnt.load(); }
+  AggregateType stat() { return global_counter->calcStat(); }
+  bool active() const { return global_counter->active(); }
+};
+
+struct NoopCounter {
+  using GlobalCounter = GlobalStat<NoopCounter>;
+  using AggregateType = uint64_t;
+  constexpr NoopCounter(GlobalCounter *globalCounter) {}
+  NoopCounter(const NoopCounter &) = delete;
+  NoopCounter(NoopCounter &&) = delete;
+  void add(int d = 1) {}
+  uint64_t operator++() { return 0; }
+  uint64_t operator++(int) { return 0; }
+  uint64_t operator+=(uint64_t d) { return 0; }
+  AggregateType aggregate(AggregateType prev) { return AggregateType{}; }
+  AggregateType stat() { return AggregateType{}; }
+  constexpr bool active() const { return false; }
+};
+
+/** global stat of a disabled timer or counter
+ * Constant-initialized and trivially destructible, and never registered anywhere, so together with
+ * a `thread_local` noop stat it leaves nothing in the binary: no static constructor, no map entry
+ * and no TLS access.
+ */
+template <typename Agg>
+struct NoopGlobalStat {
+  constexpr NoopGlobalStat(const char *name, const char *desc = "") {}
+  NoopGlobalStat(const NoopGlobalStat &) = delete;
+  NoopGlobalStat(NoopGlobalStat &&) = delete;
+  Agg calcStat() { return Agg{}; }
+  constexpr bool active() const { return false; }
+  void setEnabled(bool on) {}
+  static void printStats() {}
+  template <typename F>
+  static void forEach(F &&f) {}
+};
+
+template <>
+struct GlobalStat<NoopTimer> : NoopGlobalStat<TimerAgg> {
+  using NoopGlobalStat::NoopGlobalStat;
+};
+
+template <>
+struct GlobalStat<NoopCounter> : NoopGlobalStat<uint64_t> {
+  using NoopGlobalStat::NoopGlobalStat;
+};
+
+// a disabled multi-metric timer (`NO_STAT` or a disabled category) isn't registered
+template <>
+class MetricsRegistration<GlobalStat<NoopTimer>> {
+public:
+  constexpr MetricsRegistration(GlobalStat<NoopTimer> *g) {}
+  MetricsRegistration(const MetricsRegistration &) = delete;
+  MetricsRegistration(MetricsRegistration &&) = delete;
+};
+
+/** value of a gauge, the sum of all threads' deltas */
+struct GaugeAgg {
+  int64_t value = 0;
+  // sum of the per-thread high-water marks, see `PerThreadGaugeT`
+  int64_t hwm = 0;
+  // false for gauges that don't track one
+  bool has_hwm = false;
+};
+
+/** aggregate of a gauge that tracks a high-water mark, which it has even before any update */
+struct HwmGaugeAgg : GaugeAgg {
+  HwmGaugeAgg() { has_hwm = true; }
+};
+
+/** per-thread part of a gauge: a signed delta that goes up and down
+ * The gauge's value is the sum of the deltas of all threads, exited ones included, so a thread may
+ * decrement what another one incremented. With `kTrackMax` each thread also keeps the highest value
+ * its own delta reached; their sum bounds the peak of the gauge from above, and is that peak's
+ * best estimate when every thread balances its own increments (e.g. in-flight requests, bytes
+ * allocated & freed on the same thread).
+ * A gauge is a level rather than a count: skipping updates while it's switched off would leave
+ * it off by whatever happened meanwhile, so it ignores `set_enabled`.
+ */
+template <bool kTrackMax>
+struct _HWSTAT_SLOT_ALIGN PerThreadGaugeT {
+  using GlobalGauge = GlobalStat<PerThreadGaugeT>;
+  using AggregateType = std::conditional_t<kTrackMax, HwmGaugeAgg, GaugeAgg>;
+  BasicSlot<int64_t> value;
+  BasicSlot<int64_t> hwm;
+  GlobalGauge *global_gauge;
+  std::atomic<PerThreadGaugeT *> reg_next{nullptr};
+  PerThreadGaugeT(GlobalGauge *globalGauge) : global_gauge(globalGauge) {
+    globalGauge->reg(this);
+  }
+  PerThreadGaugeT(const PerThreadGaugeT &) = delete;
+  PerThreadGaugeT(PerThreadGaugeT &&) = delete;
+  ~PerThreadGaugeT() { global_gauge->dereg(this); }
+  void add(int64_t d = 1) {
+    auto v = value.add(d);
+    if constexpr (kTrackMax) {
+      if (v > hwm.load()) {
+        hwm.store(v);
+      }
+    }
+  }
+  void operator++() { add(1); }
+  void operator++(int) { add(1); }
+  void operator--() { add(-1); }
+  void operator--(int) { add(-1); }
+  void operator+=(int64_t d) { add(d); }
+  void operator-=(int64_t d) { add(-d); }
+  AggregateType aggregate(AggregateType prev) {
+    prev.value += value.load();
+    prev.hwm += hwm.load();
+    return prev;
+  }
+  AggregateType stat() { return global_gauge->calcStat(); }
+};
+
+using PerThreadGauge = PerThreadGaugeT<false>;
+/** gauge that also tracks a high-water mark */
+using PerThreadHwmGauge = PerThreadGaugeT<true>;
+
+struct NoopGauge {
+  using GlobalGauge = GlobalStat<NoopGauge>;
+  using AggregateType = GaugeAgg;
+  constexpr NoopGauge(GlobalGauge *globalGauge) {}
+  NoopGauge(const NoopGauge &) = delete;
+  NoopGauge(NoopGauge &&) = delete;
+  void add(int64_t d = 1) {}
+  void operator++() {}
+  void operator++(int) {}
+  void operator--() {}
+  void operator--(int) {}
+  void operator+=(int64_t d) {}
+  void operator-=(int64_t d) {}
+  AggregateType aggregate(AggregateType prev) { return AggregateType{}; }
+  AggregateType stat() { return AggregateType{}; }
+};
+
+template <>
+struct GlobalStat<NoopGauge> : NoopGlobalStat<GaugeAgg> {
+  using NoopGlobalStat::NoopGlobalStat;
+};
+
+#ifdef HWSTAT_ARENA_SLOTS
+constexpr size_t kArenaSlots = HWSTAT_ARENA_SLOTS;
+#else
+constexpr size_t kArenaSlots = 1024;
+#endif
+
+/** slots of all arena stats of one thread, see `HWSTAT_ARENA` */
+struct alignas(kCacheLineSize) Arena {
+  // the slots past `kArenaSlots` take the updates of stats that didn't fit
+  Slot slots[kArenaSlots + 2];
+  std::atomic<Arena *> reg_next{nullptr};
+};
+
+/** all arenas, and the values left behind by exited threads */
+class ArenaPool {
+  // serializes `release` and guards `gone`
+  std::mutex mtx;
+  RegList<Arena> arenas;
+  Epoch epoch;
+  // bumped by every `release` so that readers can detect a concurrent fold into `gone`
+  std::atomic<uint64_t> retired{0};
+  uint64_t gone[kArenaSlots] = {};
+  std::atomic<size_t> used{0};
+
+  static inline thread_local Slot *tls_slots = nullptr;
+
+  struct Owner {
+    Arena *arena = nullptr;
+    ~Owner() {
+      // updates made by later thread_local destructors are dropped
+      static Arena discarded;
+      tls_slots = discarded.slots;
+      get().release(arena);
+    }
+  };
+
+  static Slot *attach() {
+    static thread_local Owner owner;
+    owner.arena = new Arena();
+    get().arenas.push(owner.arena);
+    return tls_slots = owner.arena->slots;
+  }
+
+  void release(Arena *arena) {
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      for (size_t i = 0; i < kArenaSlots; i++) {
+        gone[i] += arena->slots[i].load();
+      }
+      arenas.remove(arena);
+      retired.fetch_add(1);
+      epoch.synchronize();
+    }
+    delete arena;
+  }
+
+public:
+  static ArenaPool &get() {
+    static ArenaPool pool;
+    return pool;
+  }
+
+  // the slots of the calling thread
+  static Slot *local() {
+    Slot *ret = tls_slots;
+    if (__builtin_expect(ret == nullptr, 0)) {
+      ret = attach();
+    }
+    return ret;
+  }
+
+  // the first of `n` consecutive slots for the stat `name`
+  size_t alloc(size_t n, const char *name) {
+    auto ret = used.fetch_add(n);
+    if (ret + n > kArenaSlots) {
+      spdlog::error("stat arena is full, {} is not recorded (raise HWSTAT_ARENA_SLOTS)", name);
+      return kArenaSlots;
+    }
+    return ret;
+  }
+  size_t size() const { return std::min(used.load(), kArenaSlots); }
+
+  /** fold the slots of all threads
+   * `init` gets the values of exited threads and `add` the slots of every live arena. Both may be
+   * called again if a thread exits in the middle.
+   */
+  template <typename Init, typename Add>
+  void fold(Init &&init, Add &&add) {
+    for (int attempt = 0;; attempt++) {
+      std::unique_lock<std::mutex> guard(mtx);
+      init(static_cast<const uint64_t *>(gone));
+      auto seen = retired.load(std::memory_order_relaxed);
+      // under heavy thread churn, stop retrying and hold off `release` for the walk
+      bool locked = attempt >= kMaxRetries;
+      if (!locked) {
+        guard.unlock();
+      }
+      {
+        EpochGuard eg(epoch);
+        arenas.forEach([&](Arena *a) { add(static_cast<const Slot *>(a->slots)); });
+      }
+      if (locked || retired.load() == seen) {
+        return;
+      }
+    }
+  }
+
+  /** the totals of every allocated slot, in a single pass over all arenas
+   * Arenas are summed column-wise into one array, 4 slots per add with AVX2 (2 with SSE2), so a
+   * scrape streams through each thread's slots once instead of walking every stat separately.
+   */
+  std::vector<uint64_t> sumAll() {
+    auto n = size();
+    std::vector<uint64_t> ret(n);
+    fold([&](const uint64_t *gone) { std::copy(gone, gone + n, ret.begin()); },
+         [&](const Slot *slots) { add_slots(ret.data(), slots, n); });
+    return ret;
+  }
+
+  // the totals of slots `idx` to `idx + N`
+  template <size_t N>
+  std::array<uint64_t, N> read(size_t idx) {
+    std::array<uint64_t, N> ret{};
+    if (idx + N > kArenaSlots) {
+      return ret;
+    }
+    fold([&](const uint64_t *gone) { std::copy(gone + idx, gone + idx + N, ret.begin()); },
+         [&](const Slot *slots) {
+           for (size_t i = 0; i < N; i++) {
+             ret[i] += slots[idx + i].load();
+           }
+         });
+    return ret;
+  }
+
+private:
+  static constexpr int kMaxRetries = 3;
+
+  static void add_slots(uint64_t *acc, const Slot *slots, size_t n) {
+    size_t i = 0;
+#if (defined(__AVX2__) || defined(__SSE2__)) && !defined(__SANITIZE_THREAD__)
+    static_assert(sizeof(Slot) == sizeof(uint64_t), "slots must be plain 64-bit words");
+    // relaxed loads of aligned 64-bit slots are plain loads, so read them as a vector; each lane
+    // is still a single untorn 64-bit load
+    auto src = reinterpret_cast<const uint64_t *>(slots);
+#ifdef __AVX2__
+    for (; i + 4 <= n; i += 4) {
+      auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(acc + i));
+      auto b = _mm256_load_si256(reinterpret_cast<const __m256i *>(src + i));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(acc + i), _mm256_add_epi64(a, b));
+    }
+#else
+    for (; i + 2 <= n; i += 2) {
+      auto a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc + i));
+      auto b = _mm_load_si128(reinterpret_cast<const __m128i *>(src + i));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(acc + i), _mm_add_epi64(a, b));
+    }
+#endif
+#endif
+    for (; i < n; i++) {
+      acc[i] += slots[i].load();
+    }
+  }
+};
+
+/** global stat of an arena counter or timer, taking `N` consecutive slots */
+template <typename Stat, size_t N>
+struct ArenaGlobalStat {
+  const char *name;
+  const char *desc;
+  Toggle toggle;
+  size_t idx;
+  ArenaGlobalStat(const char *name, const char *desc = "")
+      : name(name), desc(desc), toggle(name), idx(ArenaPool::get().alloc(N, name)) {
+    assert(name);
+    auto &r = registry();
+    std::lock_guard<std::mutex> guard(r.mtx);
+    r.stats.emplace(name, static_cast<GlobalStat<Stat> *>(this));
+  }
+  ~ArenaGlobalStat() {
+    auto &r = registry();
+    std::lock_guard<std::mutex> guard(r.mtx);
+    r.stats.erase(name);
+  }
+  ArenaGlobalStat(const ArenaGlobalStat &) = delete;
+  ArenaGlobalStat(ArenaGlobalStat &&) = delete;
+  bool active() const { return toggle.isActive(); }
+  void setEnabled(bool on) { toggle.setEnabled(on); }
+  std::array<uint64_t, N> values() { return ArenaPool::get().read<N>(idx); }
+  template <typename F>
+  static void forEach(F &&f) {
+    auto &r = registry();
+    std::lock_guard<std::mutex> guard(r.mtx);
+    for (const auto &kv : r.stats) {
+      f(kv.second);
+    }
+  }
+
+protected:
+  struct Registry {
+    std::mutex mtx;
+    std::map<const char *, GlobalStat<Stat> *> stats;
+  };
+  static Registry &registry() {
+    static Registry r;
+    return r;
+  }
+};
+
+struct ArenaCounter {
+  using GlobalCounter = GlobalStat<ArenaCounter>;
+  using AggregateType = uint64_t;
+  GlobalCounter *global_counter;
+  size_t idx;
+  ArenaCounter(GlobalCounter *globalCounter);
+  ArenaCounter(const ArenaCounter &) = delete;
+  ArenaCounter(ArenaCounter &&) = delete;
+  Slot &slot() const { return ArenaPool::local()[idx]; }
+  void add(int d = 1) {
+    if (active()) {
+      slot().add(d);
+    }
+  }
+  uint64_t operator++() { return *this += 1; }
+  uint64_t operator++(int) { return active() ? slot().add(1) - 1 : slot().load(); }
+  uint64_t operator+=(uint64_t d) { return active() ? slot().add(d) : slot().load(); }
+  AggregateType stat();
+  bool active() const;
+};
+
+struct ArenaTimer {
+  using GlobalTimer = GlobalStat<ArenaTimer>;
+  using AggregateType = TimerAgg;
+  GlobalTimer *global_timer;
+  size_t idx;
+  ArenaTimer(GlobalTimer *globalTimer);
+  ArenaTimer(const ArenaTimer &) = delete;
+  ArenaTimer(ArenaTimer &&) = delete;
+  // cycles, count and, with `HWSTAT_SUBTRACT_OVERHEAD`, raw cycles
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+  static constexpr size_t kSlots = 3;
+#else
+  static constexpr size_t kSlots = 2;
+#endif
+  void add(uint64_t dc = 0, uint64_t n = 1) {
+    auto slots = ArenaPool::local() + idx;
+    slots[0].add(dc);
+    slots[1].add(n);
+  }
+  void addRaw(uint64_t dc) {
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+    ArenaPool::local()[idx + 2].add(dc);
+#endif
+  }
+  AggregateType stat();
+  bool active() const;
+  bool begin() const { return active(); }
+  const char *name() const;
+};
+
+template <>
+struct GlobalStat<ArenaCounter> : ArenaGlobalStat<ArenaCounter, 1> {
+  using ArenaGlobalStat::ArenaGlobalStat;
+  uint64_t calcStat() { return values()[0]; }
+  // read from the result of `ArenaPool::sumAll`
+  uint64_t calcStat(const std::vector<uint64_t> &totals) const {
+    return idx < totals.size() ? totals[idx] : 0;
+  }
+  static void printStats();
+};
+
+template <>
+struct GlobalStat<ArenaTimer> : ArenaGlobalStat<ArenaTimer, ArenaTimer::kSlots> {
+  using ArenaGlobalStat::ArenaGlobalStat;
+  TimerAgg calcStat() {
+    auto v = values();
+    return from(v.data());
+  }
+  TimerAgg calcStat(const std::vector<uint64_t> &totals) const {
+    return idx + ArenaTimer::kSlots <= totals.size() ? from(&totals[idx]) : TimerAgg{};
+  }
+  static TimerAgg from(const uint64_t *v);
+  static void printStats();
+};
+
+inline ArenaCounter::ArenaCounter(GlobalCounter *globalCounter)
+    : global_counter(globalCounter), idx(globalCounter->idx) {}
+inline uint64_t ArenaCounter::stat() { return global_counter->calcStat(); }
+inline bool ArenaCounter::active() const { return global_counter->active(); }
+
+inline TimerAgg GlobalStat<ArenaTimer>::from(const uint64_t *v) {
+  TimerAgg ret;
+  ret.cycles = v[0];
+  ret.cnt = v[1];
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+  ret.raw_cycles = v[2];
+#endif
+  return ret;
+}
+
+inline ArenaTimer::ArenaTimer(GlobalTimer *globalTimer)
+    : global_timer(globalTimer), idx(globalTimer->idx) {}
+inline TimerAgg ArenaTimer::stat() { return global_timer->calcStat(); }
+inline bool ArenaTimer::active() const { return global_timer->active(); }
+inline const char *ArenaTimer::name() const { return global_timer->name; }
+
+#ifndef NO_STAT
+#ifdef HWSTAT_ARENA
+using CounterType = ArenaCounter;
+using TimerType = ArenaTimer;
+#else
+using CounterType = PerThreadCounter;
+using TimerType = PerThreadTimer;
+#endif
+using MomentsTimerType = PerThreadMomentsTimer;
+using HistTimerType = PerThreadHistTimer;
+using SampledTimerType = PerThreadSampledTimer;
+using CpuTimerType = PerThreadCpuTimer;
+using PmuTimerType = PerThreadPmuTimer;
+using GaugeType = PerThreadGauge;
+using HwmGaugeType = PerThreadHwmGauge;
+template <typename... Sources>
+using MetricsTimerType = PerThreadMetricsTimer<Sources...>;
+#else
+using CounterType = NoopCounter;
+using TimerType = NoopTimer;
+using MomentsTimerType = NoopTimer;
+using HistTimerType = NoopTimer;
+using SampledTimerType = NoopTimer;
+using CpuTimerType = NoopTimer;
+using PmuTimerType = NoopTimer;
+using GaugeType = NoopGauge;
+using HwmGaugeType = NoopGauge;
+template <typename... Sources>
+using MetricsTimerType = NoopTimer;
+#endif
+
+/** stat categories that are enabled or disabled at compile time
+ * A category is any type with a `static constexpr bool enabled`, e.g. declared with
+ * `HWSTAT_CATEGORY(net, true)`, and is passed as the last argument of a stat macro:
+ * `TIMER(net_parse, "parse a packet", static, net)`. Every stat macro but `MULTI_TIMER` takes one.
+ * Stats of a disabled category are noops, see `CategoryStat`.
+ */
+template <typename Stat>
+struct NoopOf {
+  using type = NoopTimer;
+};
+
+template <>
+struct NoopOf<PerThreadCounter> {
+  using type = NoopCounter;
+};
+
+template <>
+struct NoopOf<NoopCounter> {
+  using type = NoopCounter;
+};
+
+template <>
+struct NoopOf<ArenaCounter> {
+  using type = NoopCounter;
+};
+
+template <bool kTrackMax>
+struct NoopOf<PerThreadGaugeT<kTrackMax>> {
+  using type = NoopGauge;
+};
+
+template <>
+struct NoopOf<NoopGauge> {
+  using type = NoopGauge;
+};
+
+template <typename Stat, typename Category>
+using CategoryType = std::conditional_t<Category::enabled, Stat, typename NoopOf<Stat>::type>;
+
+// the thread's instance of `Stat`, registered with `*Global` on first use; `Args` follow `Global`
+// in the constructor call, e.g. a sampling rate
+template <typename Stat, auto *Global, auto... Args>
+struct CategoryLocal {
+  static inline thread_local Stat value{Global, Args...};
+};
+
+#ifdef HWSTAT_ARENA
+// arena stats aren't thread-local themselves, as with `_HWSTAT_LOCAL`
+template <auto *Global>
+struct CategoryLocal<ArenaTimer, Global> {
+  static inline ArenaTimer value{Global};
+};
+
+template <auto *Global>
+struct CategoryLocal<ArenaCounter, Global> {
+  static inline ArenaCounter value{Global};
+};
+#endif
+
+/** the variable that a stat macro with a category defines, a plain static object either way
+ * When the category is enabled it stands for the calling thread's `Stat` (see `CategoryLocal`) and
+ * forwards to it, otherwise it's the noop stat itself: no thread storage, no constructor and
+ * nothing registered anywhere.
+ */
+template <bool kEnabled, typename Stat, auto *Global, auto... Args>
+struct CategoryStatT : NoopOf<Stat>::type {
+  using Noop = typename NoopOf<Stat>::type;
+  constexpr CategoryStatT(decltype(Global) global) : Noop(nullptr) {}
+  Noop &local() { return *this; }
+};
+
+template <typename Stat, auto *Global, auto... Args>
+struct CategoryStatT<true, Stat, Global, Args...> {
+  using AggregateType = typename Stat::AggregateType;
+  constexpr CategoryStatT(decltype(Global) global) {}
+  CategoryStatT(const CategoryStatT &) = delete;
+  CategoryStatT(CategoryStatT &&) = delete;
+  static Stat &local() { return CategoryLocal<Stat, Global, Args...>::value; }
+  template <typename... A>
+  void add(A... args) {
+    local().add(args...);
+  }
+  void addRaw(uint64_t dc) { local().addRaw(dc); }
+  decltype(auto) operator++() { return ++local(); }
+  decltype(auto) operator++(int) { return local()++; }
+  decltype(auto) operator--() { return --local(); }
+  decltype(auto) operator--(int) { return local()--; }
+  template <typename D>
+  decltype(auto) operator+=(D d) {
+    return local() += d;
+  }
+  template <typename D>
+  decltype(auto) operator-=(D d) {
+    return local() -= d;
+  }
+  AggregateType stat() { return local().stat(); }
+  bool active() const { return local().active(); }
+  bool begin() { return local().begin(); }
+  const char *name() const { return local().name(); }
+};
+
+template <typename Stat, typename Category, auto *Global, auto... Args>
+using CategoryStat = CategoryStatT<Category::enabled, Stat, Global, Args...>;
+
+// the stat that a stopwatch of `Timer` records into: the calling thread's one for a `CategoryStat`
+template <typename Timer>
+struct LocalStat {
+  using type = Timer;
+  static Timer &get(Timer &timer) { return timer; }
+};
+
+template <bool kEnabled, typename Stat, auto *Global, auto... Args>
+struct LocalStat<CategoryStatT<kEnabled, Stat, Global, Args...>> {
+  using type = std::remove_reference_t<
+      decltype(std::declval<CategoryStatT<kEnabled, Stat, Global, Args...> &>().local())>;
+  static type &get(CategoryStatT<kEnabled, Stat, Global, Args...> &timer) { return timer.local(); }
+};
+
+template <typename T, typename = void>
+struct IsCategory : std::false_type {};
+
+template <typename T>
+struct IsCategory<T, std::void_t<decltype(T::enabled)>> : std::true_type {};
+
+template <typename... T>
+constexpr bool kAnyCategory = (IsCategory<T>::value || ...);
+
+#ifdef HWSTAT_TRACE_RING
+constexpr size_t kTraceRing = HWSTAT_TRACE_RING;
+#else
+constexpr size_t kTraceRing = 4096;
+#endif
+static_assert((kTraceRing & (kTraceRing - 1)) == 0, "HWSTAT_TRACE_RING must be a power of two");
+
+struct TraceEvent {
+  const char *stat;
+  uint64_t start;
+  uint64_t duration;
+  uint32_t session; // of the writer the thread saw running
+};
+
+/** single-producer single-consumer ring of one thread's trace events */
+struct TraceRing {
+  TraceEvent events[kTraceRing];
+  // written by the owning thread
+  std::atomic<uint64_t> head{0};
+  Slot dropped;
+  // written by the drainer
+  std::atomic<uint64_t> tail{0};
+  // set once the owning thread exits while a writer runs, which frees the ring after emptying it
+  std::atomic<bool> closed{false};
+  uint32_t tid;
+  uint64_t reported = 0; // drops already written out, drainer only
+  std::atomic<TraceRing *> reg_next{nullptr};
+
+  TraceRing(uint32_t tid) : tid(tid) {}
+  void push(const char *stat, uint64_t start, uint64_t duration, uint32_t session) {
+    auto h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == kTraceRing) {
+      dropped.add(1);
+      return;
+    }
+    events[h & (kTraceRing - 1)] = {stat, start, duration, session};
+    head.store(h + 1, std::memory_order_release);
+  }
+};
+
+/** the recording side of trace mode, see `HWSTAT_TRACE`
+ * Every writer runs a session of its own, and events are tagged with the session the recording
+ * thread saw, so that a push racing with the end of one writer never shows up in the next one.
+ */
+class Tracer {
+  // of the running writer, 0 while there is none
+  static inline std::atomic<uint32_t> session{0};
+  // guarded by `mutex()`
+  static inline uint32_t last_session = 0;
+  static inline bool writing = false;
+  static inline thread_local TraceRing *tls_ring = nullptr;
+  static inline thread_local bool exited = false;
+
+  struct Owner {
+    TraceRing *ring = nullptr;
+    ~Owner() {
+      exited = true;
+      tls_ring = nullptr;
+      std::lock_guard<std::mutex> guard(mutex());
+      if (writing) {
+        ring->closed.store(true, std::memory_order_release);
+      } else {
+        // no writer is left to drain it
+        rings().remove(ring);
+        delete ring;
+      }
+    }
+  };
+
+  static TraceRing *attach() {
+    if (exited) {
+      return nullptr;
+    }
+    static thread_local Owner owner;
+    owner.ring = new TraceRing(current_tid());
+    rings().push(owner.ring);
+    return tls_ring = owner.ring;
+  }
+
+public:
+  // rings of all threads that recorded something, walked & removed from under `mutex()`
+  static RegList<TraceRing> &rings() {
+    static RegList<TraceRing> r;
+    return r;
+  }
+  // serializes the writer's drains with exiting threads
+  static std::mutex &mutex() {
+    static std::mutex m;
+    return m;
+  }
+  static bool isActive() { return session.load(std::memory_order_relaxed) != 0; }
+  static void record(const char *stat, uint64_t start, uint64_t duration) {
+    auto s = session.load(std::memory_order_relaxed);
+    if (!stat || !s) {
+      return;
+    }
+    auto ring = tls_ring;
+    if (__builtin_expect(ring == nullptr, 0) && !(ring = attach())) {
+      return;
+    }
+    ring->push(stat, start, duration, s);
+  }
+
+  friend class TraceWriter;
+};
+
+#ifdef HWSTAT_TREE_NODES
+constexpr uint32_t kTreeNodes = HWSTAT_TREE_NODES;
+#else
+constexpr uint32_t kTreeNodes = 512;
+#endif
+
+/** aggregated call path, the root has no name */
+struct CallNode {
+  const char *name = nullptr;
+  uint64_t cnt = 0;
+  uint64_t cycles = 0;       // inclusive
+  uint64_t child_cycles = 0; // spent in timed children
+  std::map<const char *, CallNode> children;
+
+  uint64_t getSelfCycles() const { return cycles > child_cycles ? cycles - child_cycles : 0; }
+};
+
+/** per-thread call paths of running stopwatches, see `HWSTAT_TREE`
+ * Every thread records into its own fixed array of nodes, one per distinct call path. Nodes are
+ * only appended, and a node's name & parent are written before `size` publishes it, so readers
+ * walk the arrays of live threads lock-free; an exiting thread folds its nodes into `gone`.
+ */
+class CallTree {
+public:
+  // what `enter` returns when a thread's nodes are exhausted
+  static constexpr uint32_t kUntracked = kTreeNodes;
+
+private:
+  struct Node {
+    const char *name = nullptr;
+    uint32_t parent = 0;
+    // first child & next sibling, only used by the owning thread
+    uint32_t child = 0;
+    uint32_t sibling = 0;
+    Slot cnt;
+    Slot cycles;
+    Slot child_cycles;
+  };
+
+  struct Thread {
+    Node nodes[kTreeNodes];
+    std::atomic<uint32_t> size{1}; // node 0 is the root
+    uint32_t current = 0;
+    std::atomic<Thread *> reg_next{nullptr};
+  };
+
+  // serializes `release` and guards `gone`
+  std::mutex mtx;
+  RegList<Thread> threads;
+  Epoch epoch;
+  // bumped by every `release` so that readers can detect a concurrent fold into `gone`
+  std::atomic<uint64_t> retired{0};
+  CallNode gone;
+
+  static inline thread_local Thread *tls_thread = nullptr;
+  static inline thread_local bool exited = false;
+
+  struct Owner {
+    Thread *thread = nullptr;
+    ~Owner() {
+      // regions stopped by later thread_local destructors are dropped
+      exited = true;
+      tls_thread = nullptr;
+      get().release(thread);
+    }
+  };
+
+  static Thread *attach() {
+    if (exited) {
+      return nullptr;
+    }
+    static thread_local Owner owner;
+    owner.thread = new Thread();
+    get().threads.push(owner.thread);
+    return tls_thread = owner.thread;
+  }
+
+  void release(Thread *thread) {
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      merge(gone, thread);
+      threads.remove(thread);
+      retired.fetch_add(1);
+      epoch.synchronize();
+    }
+    delete thread;
+  }
+
+  // add the nodes of `thread` to the tree under `root`
+  static void merge(CallNode &root, const Thread *thread) {
+    auto n = thread->size.load(std::memory_order_acquire);
+    // parents are appended before their children
+    std::vector<CallNode *> paths(n);
+    paths[0] = &root;
+    for (uint32_t i = 1; i < n; i++) {
+      auto &node = thread->nodes[i];
+      auto &agg = paths[node.parent]->children[node.name];
+      agg.name = node.name;
+      agg.cnt += node.cnt.load();
+      agg.cycles += node.cycles.load();
+      agg.child_cycles += node.child_cycles.load();
+      paths[i] = &agg;
+    }
+  }
+
+public:
+  static CallTree &get() {
+    static CallTree tree;
+    return tree;
+  }
+
+  /** start a region of the timer `name` on the calling thread, the result goes to `exit` */
+  static uint32_t enter(const char *name) {
+    auto t = tls_thread;
+    if (__builtin_expect(t == nullptr, 0) && !(t = attach())) {
+      return kUntracked;
+    }
+    auto &cur = t->nodes[t->current];
+    for (auto i = cur.child; i; i = t->nodes[i].sibling) {
+      if (t->nodes[i].name == name) {
+        return t->current = i;
+      }
+    }
+    auto n = t->size.load(std::memory_order_relaxed);
+    if (n == kTreeNodes) {
+      static std::atomic<bool> warned{false};
+      if (!warned.exchange(true)) {
+        spdlog::error("call tree is full, {} is not recorded (raise HWSTAT_TREE_NODES)", name);
+      }
+      return kUntracked;
+    }
+    auto &node = t->nodes[n];
+    node.name = name;
+    node.parent = t->current;
+    node.sibling = cur.child;
+    cur.child = n;
+    t->size.store(n + 1, std::memory_order_release);
+    return t->current = n;
+  }
+
+  /** stop the region `idx` returned by `enter` after `cycles` */
+  static void exit(uint32_t idx, uint64_t cycles) {
+    auto t = tls_thread;
+    if (idx == kUntracked || !t) {
+      return;
+    }
+    auto &node = t->nodes[idx];
+    node.cnt.add(1);
+    node.cycles.add(cycles);
+    t->nodes[node.parent].child_cycles.add(cycles);
+    // a region stopped out of order leaves the stack alone
+    if (t->current == idx) {
+      t->current = node.parent;
+    }
+  }
+
+  /** drop the region `idx` returned by `enter` without recording it */
+  static void leave(uint32_t idx) {
+    auto t = tls_thread;
+    if (idx == kUntracked || !t) {
+      return;
+    }
+    if (t->current == idx) {
+      t->current = t->nodes[idx].parent;
+    }
+  }
+
+  /** call paths of all threads merged by timer */
+  CallNode collect() {
+    for (int attempt = 0;; attempt++) {
+      std::unique_lock<std::mutex> guard(mtx);
+      auto ret = gone;
+      auto seen = retired.load(std::memory_order_relaxed);
+      // under heavy thread churn, stop retrying and hold off `release` for the walk
+      bool locked = attempt >= kMaxRetries;
+      if (!locked) {
+        guard.unlock();
+      }
+      {
+        EpochGuard eg(epoch);
+        threads.forEach([&](const Thread *t) { merge(ret, t); });
+      }
+      if (locked || retired.load() == seen) {
+        return ret;
+      }
+    }
+  }
+
+private:
+  static constexpr int kMaxRetries = 3;
+};
+
+/** sink of `calibrate_overhead`: keeps the last sample, which no overhead is taken off */
+struct OverheadProbe {
+  uint64_t cycles = 0;
+  void add(uint64_t dc) { cycles = dc; }
+  bool begin() const { return true; }
+  const char *name() const { return nullptr; } // never traced
+};
+
+template <typename TimerFunc>
+uint64_t overhead_cycles();
+
+template <typename TimerFunc = RdtscTimerFunc, typename Timer = TimerType>
+class StopwatchBase {
+  Timer &timer;
+  TimerFunc timer_func;
+  uint64_t st = 0;
+  uint64_t agg = 0;
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+  // `agg` before the overhead was taken off
+  uint64_t raw = 0;
+  static constexpr bool kAdjusted = !std::is_same_v<Timer, OverheadProbe>;
+#endif
+#ifdef HWSTAT_TRACE
+  // start of the first running period, the start of the traced event
+  uint64_t trace_start;
+#endif
+#ifdef HWSTAT_TREE
+  // call tree node while running, `kUntracked` when stopped
+  uint32_t scope = CallTree::kUntracked;
+#endif
+  // sampled when a measurement starts, a stat switched off (or an entry skipped by sampling)
+  // never reads the clock
+  bool on = false;
+  // between the start of a measurement and `stop`
+  bool started = false;
+
+  uint64_t read_start() {
+    if constexpr (HasStartStop<TimerFunc>::value) {
+      return timer_func.start();
+    } else {
+      return timer_func();
+    }
+  }
+  uint64_t read_stop() {
+    if constexpr (HasStartStop<TimerFunc>::value) {
+      return timer_func.stop();
+    } else {
+      return timer_func();
+    }
+  }
+
+public:
+  StopwatchBase(Timer &timer) : timer(timer), timer_func{} { restart(); }
+#ifdef HWSTAT_TREE
+  // a stopwatch destroyed without `stop` records nothing, its region mustn't stay the parent of
+  // later ones
+  ~StopwatchBase() { CallTree::leave(scope); }
+#endif
+  void pause() {
+    if (!on) {
+      return;
+    }
+    auto dc = read_stop() - st;
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+    if constexpr (kAdjusted) {
+      raw += dc;
+      auto overhead = overhead_cycles<TimerFunc>();
+      dc = dc > overhead ? dc - overhead : 0;
+    }
+#endif
+    agg += dc;
+  }
+  void resume() {
+    if (on) {
+      st = read_start();
+#ifdef HWSTAT_TRACE
+      if (agg == 0) {
+        trace_start = st;
+      }
+#endif
+#ifdef HWSTAT_TREE
+      if (scope == CallTree::kUntracked && timer.name()) {
+        scope = CallTree::enter(timer.name());
+      }
+#endif
+    }
+  }
+  // after a `stop` this is a new entry, which goes through sampling & the runtime switch again
+  void restart() {
+    if (!started) {
+      on = timer.begin();
+      started = true;
+    }
+    resume();
+  }
+  void stop() {
+    started = false;
+    if (!on) {
+      return;
+    }
+    pause();
+    if constexpr (IsPerCpu<Timer>::value) {
+      timer.add(agg, timer_func.start_aux, timer_func.migrated);
+      timer_func.finish();
+    } else {
+      timer.add(agg);
+    }
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+    if constexpr (kAdjusted) {
+      timer.addRaw(raw);
+      raw = 0;
+    }
+#endif
+#ifdef HWSTAT_TRACE
+    Tracer::record(timer.name(), trace_start, agg);
+#endif
+#ifdef HWSTAT_TREE
+    CallTree::exit(scope, agg);
+    scope = CallTree::kUntracked;
+#endif
+    agg = 0;
+  }
+};
+
+/** measure the cost of an empty start/stop of `StopwatchBase<TimerFunc>` on the current core
+ * The median of `rounds` runs is stored in `TimerAgg::kOverheadCycles<TimerFunc>` and returned.
+ */
+template <typename TimerFunc>
+inline uint64_t calibrate_overhead(int rounds = 1001) {
+  OverheadProbe sink;
+  std::vector<uint64_t> samples(rounds);
+  for (auto &sample : samples) {
+    StopwatchBase<TimerFunc, OverheadProbe> sw(sink);
+    sw.stop();
+    sample = sink.cycles;
+  }
+  std::nth_element(samples.begin(), samples.begin() + rounds / 2, samples.end());
+  TimerAgg::kOverheadCycles<TimerFunc>.store(samples[rounds / 2], std::memory_order_relaxed);
+  TimerAgg::kOverheadCalibrated<TimerFunc>.store(true, std::memory_order_release);
+  return samples[rounds / 2];
+}
+
+/** overhead taken off each segment timed with `TimerFunc`, calibrated on the first call unless
+ * `calibrate_overhead` already ran
+ */
+template <typename TimerFunc>
+inline uint64_t overhead_cycles() {
+  if (!TimerAgg::kOverheadCalibrated<TimerFunc>.load(std::memory_order_acquire)) {
+    static const bool calibrated = (calibrate_overhead<TimerFunc>(), true);
+    (void)calibrated;
+  }
+  return TimerAgg::kOverheadCycles<TimerFunc>.load(std::memory_order_relaxed);
+}
+
+/** calibrate the measurement overhead of all tsc timer functions */
+inline void calibrate_overhead() {
+  auto rdtsc = calibrate_overhead<RdtscTimerFunc>();
+  auto rdtscp = calibrate_overhead<RdtscpTimerFunc>();
+  auto fenced = calibrate_overhead<FencedTscTimerFunc>();
+  auto cpu = calibrate_overhead<CpuTscTimerFunc>();
+  spdlog::info("measured stopwatch overhead as {} cycles(rdtsc), {} cycles(rdtscp), "
+               "{} cycles(fenced), {} cycles(per-CPU)",
+               rdtsc, rdtscp, fenced, cpu);
+  if constexpr (!std::is_same_v<DefaultTimerFunc, RdtscTimerFunc> &&
+                !std::is_same_v<DefaultTimerFunc, RdtscpTimerFunc>) {
+    auto ticks = calibrate_overhead<DefaultTimerFunc>();
+    spdlog::info("measured stopwatch overhead as {} ticks(default clock)", ticks);
+  }
+}
+
+template <typename Timer = TimerType>
+class NoopStopwatch {
+public:
+  NoopStopwatch(Timer &timer) {}
+  void pause() {}
+  void resume() {}
+  void restart() {}
+  void stop() {}
+};
+
+/** stopwatch for `PerThreadMetricsTimer`s
+ * All sources are read back-to-back after a single fence, so each extra metric costs one more read
+ * (typically an `rdpmc`) rather than a nested stopwatch.
+ */
+template <typename Timer, typename... Sources>
+class MultiStopwatch {
+  static constexpr size_t N = sizeof...(Sources);
+  Timer &timer;
+  uint64_t st[N] = {};
+  uint64_t agg[N] = {};
+  // as in `StopwatchBase`
+  bool on = false;
+  bool started = false;
+
+  void capture(uint64_t *out) {
+    lfence();
+    size_t i = 0;
+    ((out[i++] = Sources::read(*timer.perf)), ...);
+  }
+
+public:
+  MultiStopwatch(Timer &timer) : timer(timer) { restart(); }
+  void pause() {
+    if (!on) {
+      return;
+    }
+    uint64_t now[N];
+    capture(now);
+    for (size_t i = 0; i < N; i++) {
+      agg[i] += now[i] - st[i];
+    }
+  }
+  void resume() {
+    if (on) {
+      capture(st);
+    }
+  }
+  void restart() {
+    if (!started) {
+      on = timer.begin();
+      started = true;
+    }
+    resume();
+  }
+  void stop() {
+    started = false;
+    if (!on) {
+      return;
+    }
+    pause();
+    timer.add(static_cast<const uint64_t *>(agg));
+    std::fill(std::begin(agg), std::end(agg), 0);
+  }
+};
+
+template <typename Timer, typename TimerFunc>
+struct StopwatchSelector {
+  using type = StopwatchBase<TimerFunc, Timer>;
+};
+
+template <typename TimerFunc, typename... Sources>
+struct StopwatchSelector<PerThreadMetricsTimer<Sources...>, TimerFunc> {
+  using type = MultiStopwatch<PerThreadMetricsTimer<Sources...>, Sources...>;
+};
+
+// per-CPU timers need the cpu of every clock read
+template <typename TimerFunc>
+struct StopwatchSelector<PerThreadCpuTimer, TimerFunc> {
+  using type = StopwatchBase<CpuTscTimerFunc, PerThreadCpuTimer>;
+};
+
+// timers of a disabled category don't read the clock
+template <typename TimerFunc>
+struct StopwatchSelector<NoopTimer, TimerFunc> {
+  using type = NoopStopwatch<NoopTimer>;
+};
+
+#ifdef NO_STAT
+template <typename Timer, typename TimerFunc>
+using StopwatchImpl = NoopStopwatch<Timer>;
+#else
+template <typename Timer, typename TimerFunc>
+using StopwatchImpl = typename StopwatchSelector<Timer, TimerFunc>::type;
+#endif
+
+// a stopwatch of any timer kind, which is deduced from the constructor argument, e.g.
+// `BasicStopwatch sw(myVarianceTimer)`; pick another timer function per stopwatch with e.g.
+// `BasicStopwatch<TimerType, FencedTscTimerFunc>`
+template <typename Timer = TimerType, typename TimerFunc = DefaultTimerFunc>
+class BasicStopwatch : public StopwatchImpl<typename LocalStat<Timer>::type, TimerFunc> {
+  using Impl = StopwatchImpl<typename LocalStat<Timer>::type, TimerFunc>;
+
+public:
+  BasicStopwatch(Timer &timer) : Impl(LocalStat<Timer>::get(timer)) {}
+};
+
+template <typename Timer = TimerType, typename TimerFunc = DefaultTimerFunc>
+class BasicScopedTimer {
+  BasicStopwatch<Timer, TimerFunc> sw;
+
+public:
+  BasicScopedTimer(Timer &timer) : sw(timer) {}
+  ~BasicScopedTimer() { sw.stop(); }
+};
+
+// of a `TIMER` with the default timer function
+using Stopwatch = BasicStopwatch<>;
+using ScopedTimer = BasicScopedTimer<>;
+
+/** counts into a local variable and adds it to `counter` at once
+ * Unlike the thread-local counter, which other threads may read, the local count can stay in a
+ * register and doesn't keep the compiler from vectorizing the loop around it. It's added on
+ * `flush()` and on destruction, and with `kFlushEvery` also every that many increments (see
+ * `CounterBatch`), so that a long loop still shows progress at the cost of a branch.
+ */
+template <typename Counter = CounterType, uint64_t kFlushEvery = 0>
+class LocalCounter {
+  Counter &counter;
+  uint64_t pending = 0;
+
+public:
+  LocalCounter(Counter &counter) : counter(counter) {}
+  LocalCounter(const LocalCounter &) = delete;
+  LocalCounter(LocalCounter &&) = delete;
+  ~LocalCounter() { flush(); }
+  void add(uint64_t d = 1) {
+    pending += d;
+    if constexpr (kFlushEvery > 0) {
+      if (pending >= kFlushEvery) {
+        flush();
+      }
+    }
+  }
+  void operator++() { add(1); }
+  void operator++(int) { add(1); }
+  void operator+=(uint64_t d) { add(d); }
+  void flush() {
+    if (pending) {
+      counter += pending;
+      pending = 0;
+    }
+  }
+};
+
+/** `LocalCounter` that's also added every `N` increments
+ * e.g. `CounterBatch<4096> batch(myCounter)`
+ */
+template <uint64_t N, typename Counter = CounterType>
+using CounterBatch = LocalCounter<Counter, N>;
+
+/** times many short regions into local variables and adds them to `timer` at once
+ * Each `start()`/`stop()` pair reads the clock twice and adds locally; the total time and count go
+ * to the timer on `flush()` and on destruction. Only timers that just count (`TIMER`) take
+ * batches, and the regions aren't traced nor part of the call tree.
+ */
+template <typename Timer = TimerType, typename TimerFunc = DefaultTimerFunc>
+class LocalTimer {
+  Timer &timer;
+  TimerFunc timer_func{};
+  uint64_t st = 0;
+  uint64_t cycles = 0;
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+  uint64_t raw = 0;
+#endif
+  uint64_t cnt = 0;
+  // sampled once, as by `Stopwatch`
+  bool on;
+
+public:
+  LocalTimer(Timer &timer) : timer(timer), on(timer.begin()) {}
+  LocalTimer(const LocalTimer &) = delete;
+  LocalTimer(LocalTimer &&) = delete;
+  ~LocalTimer() { flush(); }
+  void start() {
+    if (!on) {
+      return;
+    }
+    if constexpr (HasStartStop<TimerFunc>::value) {
+      st = timer_func.start();
+    } else {
+      st = timer_func();
+    }
+  }
+  void stop() {
+    if (!on) {
+      return;
+    }
+    uint64_t now;
+    if constexpr (HasStartStop<TimerFunc>::value) {
+      now = timer_func.stop();
+    } else {
+      now = timer_func();
+    }
+    auto dc = now - st;
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+    raw += dc;
+    auto overhead = overhead_cycles<TimerFunc>();
+    dc = dc > overhead ? dc - overhead : 0;
+#endif
+    cycles += dc;
+    cnt++;
+  }
+  void flush() {
+    if (cnt) {
+      timer.add(cycles, cnt);
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+      timer.addRaw(raw);
+      raw = 0;
+#endif
+      cycles = cnt = 0;
+    }
+  }
 };
 
 static inline std::string format_time(double nanos) {
@@ -268,100 +3205,2381 @@ static inline std::string format_time(double nanos) {
     nanos /= 1000;
     idx++;
   }
-  return fmt::format("{:.3}{}", nanos, units[idx]);
+  return fmt::format("{:.3}{}", nanos, units[idx]);
+}
+
+static inline std::string format_rate(double per_sec) {
+  constexpr const char *units[] = {"", "K", "M", "G"};
+  int idx = 0;
+  while (per_sec >= 1000 && idx < 3) {
+    per_sec /= 1000;
+    idx++;
+  }
+  return fmt::format("{:.3}{}/s", per_sec, units[idx]);
+}
+
+template <typename T>
+static inline size_t get_max_strlen(const std::map<const char *, T *> &stats) {
+  size_t ret = 0;
+  for (const auto kv : stats) {
+    ret = std::max(ret, strlen(kv.first));
+  }
+  return ret;
+}
+
+template <typename Map, typename Calc>
+static inline void print_timer_table(const Map &stats, Calc &&calc) {
+  if (stats.size() == 0) {
+    spdlog::info("NO TIMERS");
+    return;
+  }
+  auto l = std::max(8UL, get_max_strlen(stats) + 2);
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+  spdlog::info("======TIMERS(freq = {:.3}Ghz, overhead = {} cycles(rdtsc), {} cycles(rdtscp) "
+               "subtracted)======",
+               TimerAgg::freqGhz(), overhead_cycles<RdtscTimerFunc>(),
+               overhead_cycles<RdtscpTimerFunc>());
+#else
+  spdlog::info("======TIMERS(freq = {:.3}Ghz)======", TimerAgg::freqGhz());
+#endif
+  spdlog::info("{:<{}}TIME\tCOUNT\tAVERAGE\t\tDESCRIPTION", "NAME", l);
+  for (const auto kv : stats) {
+    auto timer = kv.second;
+    auto agg = calc(timer);
+    auto tot_nanos = agg.getNanos();
+    auto avg_nanos = agg.cycles == 0 ? "N/A" : format_time(agg.getAvgNanos());
+    auto avg_cycles = agg.cycles == 0 ? "N/A" : std::to_string(agg.getAvgCycles());
+    spdlog::info("{:<{}}{}\t{}\t{}({} cycles)\t{}", timer->name, l, format_time(tot_nanos), agg.cnt,
+                 avg_nanos, avg_cycles, timer->desc);
+  }
+}
+
+template <typename Map, typename Calc>
+static inline void print_counter_table(const Map &stats, Calc &&calc) {
+  if (stats.size() == 0) {
+    spdlog::info("NO COUNTERS");
+    return;
+  }
+  auto l = std::max(8UL, get_max_strlen(stats) + 2);
+  spdlog::info("======COUNTERS======");
+  spdlog::info("{:<{}}\tCOUNT\tDESCRIPTION", "NAME", l);
+  for (const auto &kv : stats) {
+    auto counter = kv.second;
+    spdlog::info("{:<{}}{}\t{}", counter->name, l, calc(counter), counter->desc);
+  }
+}
+
+template <>
+inline void GlobalStat<PerThreadTimer>::printStats() {
+  print_timer_table(registry().stats, [](auto t) { return t->calcStat(); });
+}
+
+template <>
+inline void GlobalStat<PerThreadCounter>::printStats() {
+  print_counter_table(registry().stats, [](auto c) { return c->calcStat(); });
+}
+
+inline void GlobalStat<ArenaTimer>::printStats() {
+  auto totals = ArenaPool::get().sumAll();
+  print_timer_table(registry().stats, [&](auto t) { return t->calcStat(totals); });
+}
+
+inline void GlobalStat<ArenaCounter>::printStats() {
+  auto totals = ArenaPool::get().sumAll();
+  print_counter_table(registry().stats, [&](auto c) { return c->calcStat(totals); });
+}
+
+template <>
+inline void GlobalStat<PerThreadMomentsTimer>::printStats() {
+  auto &stats = registry().stats;
+  if (stats.size() == 0) {
+    return;
+  }
+  auto l = std::max(8UL, get_max_strlen(stats) + 2);
+  spdlog::info("======VARIANCE TIMERS(freq = {:.3}Ghz)======", TimerAgg::freqGhz());
+  spdlog::info("{:<{}}TIME\tCOUNT\tAVERAGE\tSTDDEV\tMIN\tMAX\tDESCRIPTION", "NAME", l);
+  for (const auto kv : stats) {
+    auto timer = kv.second;
+    auto agg = timer->calcStat();
+    if (agg.cnt == 0) {
+      spdlog::info("{:<{}}{}\t0\tN/A\tN/A\tN/A\tN/A\t{}", timer->name, l, format_time(0),
+                   timer->desc);
+      continue;
+    }
+    spdlog::info("{:<{}}{}\t{}\t{}\t{}\t{}\t{}\t{}", timer->name, l, format_time(agg.getNanos()),
+                 agg.cnt, format_time(agg.getAvgNanos()), format_time(agg.getStddevNanos()),
+                 format_time(agg.min / TimerAgg::freqGhz()),
+                 format_time(agg.max / TimerAgg::freqGhz()), timer->desc);
+  }
+}
+
+template <>
+inline void GlobalStat<PerThreadSampledTimer>::printStats() {
+  auto &stats = registry().stats;
+  if (stats.size() == 0) {
+    return;
+  }
+  auto l = std::max(8UL, get_max_strlen(stats) + 2);
+  spdlog::info("======SAMPLED TIMERS(freq = {:.3}Ghz)======", TimerAgg::freqGhz());
+  spdlog::info("{:<{}}TIME(EST)\tCOUNT\tSAMPLES\tAVERAGE\tDESCRIPTION", "NAME", l);
+  for (const auto kv : stats) {
+    auto timer = kv.second;
+    auto agg = timer->calcStat();
+    auto avg = agg.samples == 0 ? "N/A"
+                                : fmt::format("{}({} cycles)", format_time(agg.getAvgNanos()),
+                                              agg.getAvgCycles());
+    spdlog::info("{:<{}}{}\t{}\t{}\t{}\t{}", timer->name, l, format_time(agg.getNanos()),
+                 agg.cnt, agg.samples, avg, timer->desc);
+  }
+}
+
+template <>
+inline void GlobalStat<PerThreadCpuTimer>::printStats() {
+  auto &stats = registry().stats;
+  if (stats.size() == 0) {
+    return;
+  }
+  auto l = std::max(8UL, get_max_strlen(stats) + 2);
+  spdlog::info("======CPU TIMERS(freq = {:.3}Ghz)======", TimerAgg::freqGhz());
+  spdlog::info("{:<{}}TIME\tCOUNT\tAVERAGE\tMIGRATIONS\tDESCRIPTION", "NAME", l);
+  for (const auto kv : stats) {
+    auto timer = kv.second;
+    auto agg = timer->calcStat();
+    auto avg = [](const TimerAgg &a) { return a.cnt == 0 ? "N/A" : format_time(a.getAvgNanos()); };
+    spdlog::info("{:<{}}{}\t{}\t{}\t{}\t\t{}", timer->name, l, format_time(agg.getNanos()), agg.cnt,
+                 avg(agg), agg.migrations, timer->desc);
+    agg.forEachPart([&](const char *kind, size_t id, const TimerAgg &part) {
+      spdlog::info("{:<{}}{}\t{}\t{}", fmt::format("  {}{}", kind, id), l,
+                   format_time(part.getNanos()), part.cnt, avg(part));
+    });
+  }
+}
+
+template <>
+inline void GlobalStat<PerThreadHistTimer>::printStats() {
+  auto &stats = registry().stats;
+  if (stats.size() == 0) {
+    return;
+  }
+  auto l = std::max(8UL, get_max_strlen(stats) + 2);
+  spdlog::info("======HISTOGRAMS(freq = {:.3}Ghz)======", TimerAgg::freqGhz());
+  spdlog::info("{:<{}}COUNT\tAVERAGE\tP50\tP90\tP99\tP999\tMAX\tDESCRIPTION", "NAME", l);
+  for (const auto kv : stats) {
+    auto timer = kv.second;
+    auto agg = timer->calcStat();
+    auto pct = [&](double q) { return format_time(agg.getPercentileNanos(q)); };
+    auto avg_nanos = agg.cnt == 0 ? "N/A" : format_time(agg.getAvgNanos());
+    spdlog::info("{:<{}}{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}", timer->name, l, agg.cnt, avg_nanos,
+                 pct(0.5), pct(0.9), pct(0.99), pct(0.999),
+                 format_time(agg.max / TimerAgg::freqGhz()), timer->desc);
+  }
+}
+
+inline void SimpleStat::printStats() {
+  if (stats.size() == 0) {
+    spdlog::info("NO USER STATS");
+    return;
+  }
+  auto l = std::max(8UL, get_max_strlen(stats) + 2);
+  spdlog::info("======USER STATS======");
+  spdlog::info("{:<{}}\tVALUE\tDESCRIPTION", "NAME", l);
+  for (const auto &kv : stats) {
+    auto val = kv.second->callback();
+    spdlog::info("{:<{}}{}\t{}", kv.first, l, val, kv.second->desc);
+  }
+}
+
+inline void NumericStat::printStats() {
+  if (stats.size() == 0) {
+    return;
+  }
+  auto l = std::max(8UL, get_max_strlen(stats) + 2);
+  spdlog::info("======NUMERIC STATS======");
+  spdlog::info("{:<{}}VALUE\tDESCRIPTION", "NAME", l);
+  for (const auto &kv : stats) {
+    char buf[32];
+    spdlog::info("{:<{}}{}\t{}", kv.first, l, kv.second->value().format(buf), kv.second->desc);
+  }
+}
+
+static inline std::string format_metrics(const MetricsAgg &agg) {
+  std::string ret;
+  for (size_t i = 0; i < agg.n; i++) {
+    if (agg.cnt == 0) {
+      ret += fmt::format("{}=N/A\t", agg.names[i]);
+    } else if (strcmp(agg.names[i], metric::Tsc::kName) == 0) {
+      ret += fmt::format("{}/op\t", format_time(agg.getPerCall(i) / TimerAgg::freqGhz()));
+    } else {
+      ret += fmt::format("{}={:.4}/op\t", agg.names[i], agg.getPerCall(i));
+    }
+  }
+  if (auto ipc = agg.getIpc()) {
+    ret += fmt::format("ipc={:.3}\t", ipc);
+  }
+  return ret;
+}
+
+template <typename T>
+static inline void print_metrics_entries(const char *title, const T &entries) {
+  if (entries.empty()) {
+    return;
+  }
+  size_t l = 8;
+  for (const auto &e : entries) {
+    l = std::max(l, strlen(e.name) + 2);
+  }
+  spdlog::info("======{}======", title);
+  spdlog::info("{:<{}}COUNT\tMETRICS\tDESCRIPTION", "NAME", l);
+  for (const auto &e : entries) {
+    spdlog::info("{:<{}}{}\t{}{}", e.name, l, e.value.cnt, format_metrics(e.value), e.desc);
+  }
+}
+
+inline void print_timer_stats() {
+  GlobalStat<TimerType>::printStats();
+#ifndef NO_STAT
+  GlobalStat<MomentsTimerType>::printStats();
+  GlobalStat<HistTimerType>::printStats();
+  GlobalStat<SampledTimerType>::printStats();
+  GlobalStat<CpuTimerType>::printStats();
+  struct Entry {
+    const char *name;
+    const char *desc;
+    MetricsAgg value;
+  };
+  std::vector<Entry> metrics;
+  MetricsRegistry::get().forEach([&](auto name, auto desc, const MetricsAgg &agg) {
+    metrics.push_back({name, desc, agg});
+  });
+  print_metrics_entries("METRIC TIMERS", metrics);
+#endif
+}
+inline void print_counter_stats() { GlobalStat<CounterType>::printStats(); }
+
+/** current values of all gauges, plain ones first */
+inline std::vector<StatEntry<GaugeAgg>> gauge_stats() {
+  std::vector<StatEntry<GaugeAgg>> ret;
+#ifndef NO_STAT
+  GlobalStat<GaugeType>::forEach([&](auto g) { ret.push_back({g->name, g->desc, g->calcStat()}); });
+  GlobalStat<HwmGaugeType>::forEach(
+      [&](auto g) { ret.push_back({g->name, g->desc, g->calcStat()}); });
+#endif
+  return ret;
+}
+
+static inline void print_gauge_entries(const std::vector<StatEntry<GaugeAgg>> &gauges) {
+  if (gauges.empty()) {
+    return;
+  }
+  size_t l = 8;
+  for (const auto &g : gauges) {
+    l = std::max(l, strlen(g.name) + 2);
+  }
+  spdlog::info("======GAUGES======");
+  spdlog::info("{:<{}}VALUE\tHWM\tDESCRIPTION", "NAME", l);
+  for (const auto &g : gauges) {
+    auto hwm = g.value.has_hwm ? std::to_string(g.value.hwm) : "N/A";
+    spdlog::info("{:<{}}{}\t{}\t{}", g.name, l, g.value.value, hwm, g.desc);
+  }
+}
+
+inline void print_gauge_stats() { print_gauge_entries(gauge_stats()); }
+inline void print_user_stats() {
+  SimpleStat::printStats();
+  NumericStat::printStats();
+}
+
+/** print the call paths recorded in `HWSTAT_TREE` mode, children below their parent by time */
+inline void print_tree_stats() {
+  auto root = CallTree::get().collect();
+  if (root.children.empty()) {
+    spdlog::info("NO CALL TREE");
+    return;
+  }
+  // widest indented name among the children of `n`
+  std::function<size_t(const CallNode &, size_t)> width = [&](const CallNode &n, size_t depth) {
+    size_t ret = 0;
+    for (const auto &kv : n.children) {
+      ret = std::max({ret, depth * 2 + strlen(kv.first), width(kv.second, depth + 1)});
+    }
+    return ret;
+  };
+  auto l = std::max(8UL, width(root, 0) + 2);
+  spdlog::info("======CALL TREE(freq = {:.3}Ghz)======", TimerAgg::freqGhz());
+  spdlog::info("{:<{}}TIME\tSELF\tSELF%\tCOUNT\tAVERAGE", "NAME", l);
+  std::function<void(const CallNode &, size_t)> print = [&](const CallNode &n, size_t depth) {
+    std::vector<const CallNode *> children;
+    for (const auto &kv : n.children) {
+      children.push_back(&kv.second);
+    }
+    std::sort(children.begin(), children.end(),
+              [](auto a, auto b) { return a->cycles > b->cycles; });
+    for (auto c : children) {
+      auto self = c->getSelfCycles();
+      spdlog::info("{:<{}}{}\t{}\t{:.1f}%\t{}\t{}", std::string(depth * 2, ' ') + c->name, l,
+                   format_time(c->cycles / TimerAgg::freqGhz()),
+                   format_time(self / TimerAgg::freqGhz()),
+                   c->cycles ? 100.0 * self / c->cycles : 0.0, c->cnt,
+                   c->cnt ? format_time(double(c->cycles) / c->cnt / TimerAgg::freqGhz()) : "N/A");
+      print(*c, depth + 1);
+    }
+  };
+  print(root, 0);
+}
+
+// defined along with snapshots
+inline void print_derived_stats();
+inline void print_thread_stats();
+
+inline void print_stats() {
+  print_timer_stats();
+#ifdef HWSTAT_TREE
+  print_tree_stats();
+#endif
+  print_counter_stats();
+  print_gauge_stats();
+  print_user_stats();
+  print_derived_stats();
+#ifdef HWSTAT_THREAD_STATS
+  print_thread_stats();
+#endif
+}
+
+/** point-in-time values of every registered stat */
+struct Snapshot {
+  template <typename V>
+  using Entry = StatEntry<V>;
+  // clock reading (`DefaultTimerFunc`, the tsc by default) taken right before the stats were
+  // collected
+  uint64_t tsc = 0;
+  std::vector<Entry<TimerAgg>> timers;
+  std::vector<Entry<MomentsAgg>> moments;
+  std::vector<Entry<HistAgg>> histograms;
+  std::vector<Entry<SampledAgg>> sampled;
+  std::vector<Entry<CpuAgg>> cpus;
+  std::vector<Entry<MetricsAgg>> metrics;
+  std::vector<Entry<uint64_t>> counters;
+  std::vector<Entry<GaugeAgg>> gauges;
+  std::vector<Entry<std::string>> user;
+  std::vector<Entry<NumericValue>> numeric;
+  // computed from the entries above, see `DerivedStat`
+  std::vector<Entry<DerivedValue>> derived;
+  // only filled in `HWSTAT_THREAD_STATS` mode, live threads after the retained exited ones
+  std::vector<ThreadStats> threads;
+};
+
+/** timers & counters broken down by thread, see `HWSTAT_THREAD_STATS` */
+inline std::vector<ThreadStats> thread_stats() {
+  std::vector<ThreadStats> ret;
+#if defined(HWSTAT_THREAD_STATS) && !defined(HWSTAT_ARENA) && !defined(NO_STAT)
+  ThreadHistory::get().visit([&](const std::vector<ThreadStats> &exited) {
+    ret = exited;
+    std::map<uint64_t, size_t> live;
+    auto find = [&](const ThreadInfo *t) -> ThreadStats & {
+      auto it = live.find(t->serial);
+      if (it == live.end()) {
+        it = live.emplace(t->serial, ret.size()).first;
+        ThreadStats s;
+        s.serial = t->serial;
+        s.tid = t->tid;
+        s.name = t->name;
+        ret.push_back(std::move(s));
+      }
+      return ret[it->second];
+    };
+    GlobalStat<PerThreadTimer>::forEach([&](auto stat) {
+      stat->forEachInstance([&](PerThreadTimer *i) {
+        find(i->thread).timers.push_back({stat->name, stat->desc, i->aggregate(TimerAgg{})});
+      });
+    });
+    GlobalStat<PerThreadCounter>::forEach([&](auto stat) {
+      stat->forEachInstance([&](PerThreadCounter *i) {
+        find(i->thread).counters.push_back({stat->name, stat->desc, i->aggregate(0)});
+      });
+    });
+  });
+#endif
+  return ret;
+}
+
+// time in nanoseconds that stands for a metrics timer in a `DerivedStat`
+static inline double derived_nanos(const MetricsAgg &v) {
+  int tsc = v.find(metric::Tsc::kName);
+  return tsc < 0 ? 0 : v.values[tsc] / TimerAgg::freqGhz();
+}
+
+// resolve `op` to the registered stat it names, false if there's none (yet)
+static inline bool resolve_operand(DerivedStat::Operand &op) {
+  if (op.stat) {
+    return true;
+  }
+#ifndef NO_STAT
+  auto name = op.token;
+  for (const char *p; (p = strstr(name, "::"));) {
+    name = p + 2;
+  }
+  // numeric stats are only reachable through their global stat
+  constexpr const char *kGlobalPrefix = "gnum_";
+  if (strncmp(name, kGlobalPrefix, strlen(kGlobalPrefix)) == 0) {
+    name += strlen(kGlobalPrefix);
+  }
+  auto match = [&](DerivedStat::Kind kind) {
+    return [&op, name, kind](auto g) {
+      if (!op.stat && strcmp(g->name, name) == 0) {
+        op.stat = g->name;
+        op.kind = kind;
+      }
+    };
+  };
+  GlobalStat<CounterType>::forEach(match(DerivedStat::Counter));
+  GlobalStat<GaugeType>::forEach(match(DerivedStat::Gauge));
+  GlobalStat<HwmGaugeType>::forEach(match(DerivedStat::Gauge));
+  NumericStat::forEach(match(DerivedStat::Numeric));
+  GlobalStat<TimerType>::forEach(match(DerivedStat::Timer));
+  GlobalStat<MomentsTimerType>::forEach(match(DerivedStat::Moments));
+  GlobalStat<HistTimerType>::forEach(match(DerivedStat::Histogram));
+  GlobalStat<SampledTimerType>::forEach(match(DerivedStat::Sampled));
+  GlobalStat<CpuTimerType>::forEach(match(DerivedStat::Cpu));
+  if (auto stat = op.stat ? nullptr : MetricsRegistry::get().find(name)) {
+    op.stat = stat;
+    op.kind = DerivedStat::Metrics;
+  }
+  if (!op.stat && !op.warned) {
+    op.warned = true;
+    spdlog::warn("derived stats: no stat is called {}", op.token);
+  }
+#endif
+  return op.stat != nullptr;
+}
+
+// value of the operand `op` in `snap`, NaN if there's none
+static inline double derived_operand(const Snapshot &snap, DerivedStat::Operand &op) {
+  constexpr auto kNaN = std::numeric_limits<double>::quiet_NaN();
+  if (!resolve_operand(op)) {
+    return kNaN;
+  }
+  auto find = [&](const auto &entries, auto &&value) {
+    for (const auto &e : entries) {
+      if (e.name == op.stat) {
+        return double(value(e.value));
+      }
+    }
+    return kNaN;
+  };
+  auto nanos = [](const auto &agg) { return agg.getNanos(); };
+  switch (op.kind) {
+  case DerivedStat::Counter:
+    return find(snap.counters, [](uint64_t v) { return v; });
+  case DerivedStat::Gauge:
+    return find(snap.gauges, [](const GaugeAgg &v) { return v.value; });
+  case DerivedStat::Numeric:
+    return find(snap.numeric, [](const NumericValue &v) { return v.get(); });
+  case DerivedStat::Timer:
+    return find(snap.timers, nanos);
+  case DerivedStat::Moments:
+    return find(snap.moments, nanos);
+  case DerivedStat::Histogram:
+    return find(snap.histograms, nanos);
+  case DerivedStat::Sampled:
+    return find(snap.sampled, nanos);
+  case DerivedStat::Cpu:
+    return find(snap.cpus, nanos);
+  case DerivedStat::Metrics:
+    return find(snap.metrics, derived_nanos);
+  }
+  return kNaN;
+}
+
+static inline DerivedValue derived_value(const DerivedStat &d, double num, double den) {
+  DerivedValue v;
+  v.per_op = d.op == DerivedStat::PerOp;
+  if (den != 0) {
+    v.value = num / den;
+  }
+  return v;
+}
+
+// (re)compute `snap.derived` from the rest of it
+static inline void derive(Snapshot &snap) {
+  snap.derived.clear();
+  DerivedStat::forEach([&](DerivedStat *d) {
+    auto v = derived_value(*d, derived_operand(snap, d->num), derived_operand(snap, d->den));
+    snap.derived.push_back({d->name, d->desc, v});
+  });
+}
+
+inline Snapshot snapshot() {
+  Snapshot ret;
+  ret.tsc = DefaultTimerFunc{}();
+#ifndef NO_STAT
+#ifdef HWSTAT_ARENA
+  // every arena stat is read from one bulk pass
+  auto totals = ArenaPool::get().sumAll();
+  GlobalStat<TimerType>::forEach(
+      [&](auto t) { ret.timers.push_back({t->name, t->desc, t->calcStat(totals)}); });
+#else
+  GlobalStat<TimerType>::forEach(
+      [&](auto t) { ret.timers.push_back({t->name, t->desc, t->calcStat()}); });
+#endif
+  GlobalStat<MomentsTimerType>::forEach(
+      [&](auto t) { ret.moments.push_back({t->name, t->desc, t->calcStat()}); });
+  GlobalStat<HistTimerType>::forEach(
+      [&](auto t) { ret.histograms.push_back({t->name, t->desc, t->calcStat()}); });
+  GlobalStat<SampledTimerType>::forEach(
+      [&](auto t) { ret.sampled.push_back({t->name, t->desc, t->calcStat()}); });
+  GlobalStat<CpuTimerType>::forEach(
+      [&](auto t) { ret.cpus.push_back({t->name, t->desc, t->calcStat()}); });
+  MetricsRegistry::get().forEach([&](auto name, auto desc, const MetricsAgg &agg) {
+    ret.metrics.push_back({name, desc, agg});
+  });
+#ifdef HWSTAT_ARENA
+  GlobalStat<CounterType>::forEach(
+      [&](auto c) { ret.counters.push_back({c->name, c->desc, c->calcStat(totals)}); });
+#else
+  GlobalStat<CounterType>::forEach(
+      [&](auto c) { ret.counters.push_back({c->name, c->desc, c->calcStat()}); });
+#endif
+#endif
+  ret.gauges = gauge_stats();
+  SimpleStat::forEach([&](auto s) { ret.user.push_back({s->name, s->desc, s->callback()}); });
+  NumericStat::forEach([&](auto s) { ret.numeric.push_back({s->name, s->desc, s->value()}); });
+  derive(ret);
+  ret.threads = thread_stats();
+  return ret;
+}
+
+// the unadjusted cycles, which every timer kind keeps with `HWSTAT_SUBTRACT_OVERHEAD`
+static inline void diff_raw(TimerAgg &ret, const TimerAgg &a, const TimerAgg &b) {
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+  ret.raw_cycles = b.raw_cycles - a.raw_cycles;
+#endif
+}
+
+static inline TimerAgg diff_value(const TimerAgg &a, const TimerAgg &b) {
+  TimerAgg ret;
+  ret.cnt = b.cnt - a.cnt;
+  ret.cycles = b.cycles - a.cycles;
+  diff_raw(ret, a, b);
+  return ret;
+}
+
+// min & max can't be taken apart, the ones since start are kept
+static inline MomentsAgg diff_value(const MomentsAgg &a, const MomentsAgg &b) {
+  MomentsAgg ret = b;
+  ret.cnt = b.cnt - a.cnt;
+  ret.cycles = b.cycles - a.cycles;
+  // the moments of the later samples alone, i.e. `addMoments` undone
+  if (ret.cnt != 0) {
+    double na = a.cnt, n = ret.cnt, nb = b.cnt;
+    ret.mean = (nb * b.mean - na * a.mean) / n;
+    double delta = ret.mean - a.mean;
+    ret.m2 = std::max(0.0, b.m2 - a.m2 - delta * delta * na * n / nb);
+  } else {
+    ret.mean = ret.m2 = 0;
+  }
+  diff_raw(ret, a, b);
+  return ret;
+}
+
+// the max can't be taken apart, the one since start is kept
+static inline HistAgg diff_value(const HistAgg &a, const HistAgg &b) {
+  HistAgg ret = b;
+  ret.cnt = b.cnt - a.cnt;
+  ret.cycles = b.cycles - a.cycles;
+  for (size_t i = 0; i < ret.buckets.size(); i++) {
+    ret.buckets[i] -= a.buckets[i];
+  }
+  diff_raw(ret, a, b);
+  return ret;
+}
+
+static inline SampledAgg diff_value(const SampledAgg &a, const SampledAgg &b) {
+  SampledAgg ret;
+  ret.cnt = b.cnt - a.cnt;
+  ret.samples = b.samples - a.samples;
+  ret.cycles = b.cycles - a.cycles;
+  diff_raw(ret, a, b);
+  return ret;
+}
+
+static inline CpuAgg diff_value(const CpuAgg &a, const CpuAgg &b) {
+  CpuAgg ret;
+  ret.cnt = b.cnt - a.cnt;
+  ret.cycles = b.cycles - a.cycles;
+  ret.migrations = b.migrations - a.migrations;
+  diff_raw(ret, a, b);
+  for (size_t i = 0; i < kMaxCpus; i++) {
+    ret.cpus[i] = diff_value(a.cpus[i], b.cpus[i]);
+  }
+  for (size_t i = 0; i < kMaxNodes; i++) {
+    ret.nodes[i] = diff_value(a.nodes[i], b.nodes[i]);
+  }
+  return ret;
+}
+
+static inline MetricsAgg diff_value(const MetricsAgg &a, const MetricsAgg &b) {
+  MetricsAgg ret = b;
+  ret.cnt = b.cnt - a.cnt;
+  for (size_t i = 0; i < b.n; i++) {
+    ret.values[i] = b.values[i] - a.values[i];
+  }
+  return ret;
+}
+
+static inline uint64_t diff_value(uint64_t a, uint64_t b) { return b - a; }
+
+// gauges are levels rather than totals, the newer value is kept
+static inline GaugeAgg diff_value(const GaugeAgg &a, const GaugeAgg &b) { return b; }
+
+// user stats are opaque strings, the newer value is kept
+static inline std::string diff_value(const std::string &a, const std::string &b) { return b; }
+
+// only totals are diffed, levels keep the newer value
+static inline NumericValue diff_value(const NumericValue &a, const NumericValue &b) {
+  NumericValue ret = b;
+  if (b.total && b.real) {
+    ret.d = b.d - a.d;
+  } else if (b.total) {
+    ret.i = int64_t(uint64_t(b.i) - uint64_t(a.i));
+  }
+  return ret;
+}
+
+template <typename V>
+static inline void diff_entries(const std::vector<Snapshot::Entry<V>> &a,
+                                const std::vector<Snapshot::Entry<V>> &b,
+                                std::vector<Snapshot::Entry<V>> &out) {
+  out.reserve(b.size());
+  for (size_t i = 0; i < b.size(); i++) {
+    // snapshots list stats in the same order unless one got registered in between
+    const Snapshot::Entry<V> *prev = i < a.size() && a[i].name == b[i].name ? &a[i] : nullptr;
+    for (size_t j = 0; !prev && j < a.size(); j++) {
+      prev = a[j].name == b[i].name ? &a[j] : nullptr;
+    }
+    out.push_back({b[i].name, b[i].desc, prev ? diff_value(prev->value, b[i].value) : b[i].value});
+  }
+}
+
+/** what happened between two snapshots
+ * Values are the differences `b - a` and `tsc` is the number of elapsed tsc cycles.
+ */
+inline Snapshot diff(const Snapshot &a, const Snapshot &b) {
+  Snapshot ret;
+  ret.tsc = b.tsc - a.tsc;
+  diff_entries(a.timers, b.timers, ret.timers);
+  diff_entries(a.moments, b.moments, ret.moments);
+  diff_entries(a.histograms, b.histograms, ret.histograms);
+  diff_entries(a.sampled, b.sampled, ret.sampled);
+  diff_entries(a.cpus, b.cpus, ret.cpus);
+  diff_entries(a.metrics, b.metrics, ret.metrics);
+  diff_entries(a.counters, b.counters, ret.counters);
+  diff_entries(a.gauges, b.gauges, ret.gauges);
+  diff_entries(a.user, b.user, ret.user);
+  diff_entries(a.numeric, b.numeric, ret.numeric);
+  derive(ret);
+  for (const auto &t : b.threads) {
+    auto prev = std::find_if(a.threads.begin(), a.threads.end(),
+                             [&](const ThreadStats &p) { return p.serial == t.serial; });
+    ThreadStats d = t;
+    if (prev != a.threads.end()) {
+      d.timers.clear();
+      d.counters.clear();
+      diff_entries(prev->timers, t.timers, d.timers);
+      diff_entries(prev->counters, t.counters, d.counters);
+    }
+    ret.threads.push_back(std::move(d));
+  }
+  return ret;
+}
+
+/** interval mode
+ * Keeps the previous snapshot so that `next()` returns only what happened since the last call (or
+ * since construction for the first one).
+ */
+class Interval {
+  Snapshot prev;
+
+public:
+  Interval() : prev(snapshot()) {}
+  Snapshot next() {
+    auto cur = snapshot();
+    auto ret = diff(prev, cur);
+    prev = std::move(cur);
+    return ret;
+  }
+};
+
+/** `DefaultTimerFunc` reading at process start
+ * Worked out on first use from the start time the kernel keeps (at clock tick resolution), so that
+ * nothing runs during static initialization. Elsewhere it's the time of the first use.
+ */
+inline uint64_t process_start_tsc() {
+  static const uint64_t ret = [] {
+    auto now = DefaultTimerFunc{}();
+    double uptime_nanos = 0;
+#ifdef __linux__
+    char buf[1024];
+    size_t n = 0;
+    if (auto f = fopen("/proc/self/stat", "r")) {
+      n = fread(buf, 1, sizeof(buf) - 1, f);
+      fclose(f);
+    }
+    buf[n] = '\0';
+    timespec ts;
+    unsigned long long start_ticks;
+    // the command name may contain spaces & parentheses, `starttime` is the 20th field after it
+    auto fields = strrchr(buf, ')');
+    if (fields && clock_gettime(CLOCK_BOOTTIME, &ts) == 0 &&
+        sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d "
+                           "%*d %*d %llu", &start_ticks) == 1) {
+      uptime_nanos = ts.tv_sec * 1e9 + ts.tv_nsec - start_ticks * 1e9 / sysconf(_SC_CLK_TCK);
+    }
+#endif
+    auto ticks = uint64_t(std::max(0.0, uptime_nanos) * TimerAgg::freqGhz());
+    return now > ticks ? now - ticks : 0;
+  }();
+  return ret;
+}
+
+/** process-wide baseline of `reset()` & `since_reset()`
+ * Resetting doesn't write to any stat, which threads own: it takes a snapshot that later ones are
+ * diffed against, so it's safe while other threads keep counting and costs them nothing. As with
+ * any `diff`, levels (gauges, min & max) aren't reset.
+ */
+class Baseline {
+  std::mutex mtx;
+  std::shared_ptr<const Snapshot> base;
+
+  Baseline() {
+    auto start = std::make_shared<Snapshot>();
+    start->tsc = process_start_tsc();
+    base = std::move(start);
+  }
+
+public:
+  static Baseline &get() {
+    static Baseline b;
+    return b;
+  }
+  void reset() {
+    auto cur = std::make_shared<const Snapshot>(snapshot());
+    std::lock_guard<std::mutex> guard(mtx);
+    base = std::move(cur);
+  }
+  Snapshot since() {
+    std::shared_ptr<const Snapshot> prev;
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      prev = base;
+    }
+    return diff(*prev, snapshot());
+  }
+};
+
+/** start a new phase, e.g. between benchmark steps, see `Baseline` */
+inline void reset() { Baseline::get().reset(); }
+/** what happened since the last `reset()`, or since startup */
+inline Snapshot since_reset() { return Baseline::get().since(); }
+
+static inline void print_derived_entries(const char *title,
+                                         const std::vector<Snapshot::Entry<DerivedValue>> &stats) {
+  if (stats.empty()) {
+    return;
+  }
+  size_t l = 8;
+  for (const auto &d : stats) {
+    l = std::max(l, strlen(d.name) + 2);
+  }
+  spdlog::info("======{}======", title);
+  spdlog::info("{:<{}}VALUE\tDESCRIPTION", "NAME", l);
+  for (const auto &d : stats) {
+    auto &v = d.value;
+    auto value = std::isnan(v.value) ? "N/A"
+                 : v.per_op          ? format_time(v.value)
+                                     : fmt::format("{:.4}", v.value);
+    spdlog::info("{:<{}}{}\t{}", d.name, l, value, d.desc);
+  }
+}
+
+/** print all `RATIO` & `PER_OP` stats, aggregating only their operands (each once) */
+inline void print_derived_stats() {
+  Snapshot snap;
+#ifndef NO_STAT
+  std::vector<const DerivedStat::Operand *> operands;
+  DerivedStat::forEach([&](DerivedStat *d) {
+    for (auto op : {&d->num, &d->den}) {
+      if (resolve_operand(*op)) {
+        operands.push_back(op);
+      }
+    }
+  });
+  auto wanted = [&](const char *name, DerivedStat::Kind kind) {
+    return std::any_of(operands.begin(), operands.end(),
+                       [&](auto op) { return op->stat == name && op->kind == kind; });
+  };
+  // the entries of `kind` that an operand names, as `snapshot` would take them
+  auto take = [&](auto &entries, DerivedStat::Kind kind) {
+    return [&entries, &wanted, kind](auto g) {
+      if (wanted(g->name, kind)) {
+        entries.push_back({g->name, g->desc, g->calcStat()});
+      }
+    };
+  };
+  GlobalStat<CounterType>::forEach(take(snap.counters, DerivedStat::Counter));
+  GlobalStat<GaugeType>::forEach(take(snap.gauges, DerivedStat::Gauge));
+  GlobalStat<HwmGaugeType>::forEach(take(snap.gauges, DerivedStat::Gauge));
+  GlobalStat<TimerType>::forEach(take(snap.timers, DerivedStat::Timer));
+  GlobalStat<MomentsTimerType>::forEach(take(snap.moments, DerivedStat::Moments));
+  GlobalStat<HistTimerType>::forEach(take(snap.histograms, DerivedStat::Histogram));
+  GlobalStat<SampledTimerType>::forEach(take(snap.sampled, DerivedStat::Sampled));
+  GlobalStat<CpuTimerType>::forEach(take(snap.cpus, DerivedStat::Cpu));
+  NumericStat::forEach([&](auto s) {
+    if (wanted(s->name, DerivedStat::Numeric)) {
+      snap.numeric.push_back({s->name, s->desc, s->value()});
+    }
+  });
+  for (auto op : operands) {
+    auto &m = snap.metrics;
+    if (op->kind == DerivedStat::Metrics &&
+        std::none_of(m.begin(), m.end(), [&](const auto &e) { return e.name == op->stat; })) {
+      m.push_back({op->stat, "", MetricsRegistry::get().calc(op->stat)});
+    }
+  }
+#endif
+  derive(snap);
+  print_derived_entries("DERIVED STATS", snap.derived);
+}
+
+/** print a `diff` with throughput and time per operation over the interval */
+inline void print_interval(const Snapshot &delta) {
+#ifdef NO_STAT
+  return;
+#endif
+  auto secs = TimerAgg::cyclesToSeconds(delta.tsc);
+  auto window_nanos = delta.tsc / TimerAgg::freqGhz();
+  auto name_len = [](const auto &entries) {
+    size_t ret = 0;
+    for (const auto &e : entries) {
+      ret = std::max(ret, strlen(e.name));
+    }
+    return std::max(8UL, ret + 2);
+  };
+  if (!delta.timers.empty()) {
+    auto l = name_len(delta.timers);
+    spdlog::info("======TIMERS(interval = {:.3}s)======", secs);
+    spdlog::info("{:<{}}TIME\tCOUNT\tRATE\tNS/OP\tDESCRIPTION", "NAME", l);
+    for (const auto &t : delta.timers) {
+      auto &agg = t.value;
+      auto avg_nanos = agg.cnt == 0 ? "N/A" : format_time(agg.getAvgNanos());
+      spdlog::info("{:<{}}{}\t{}\t{}\t{}\t{}", t.name, l, format_time(agg.getNanos()), agg.cnt,
+                   format_rate(agg.cnt / secs), avg_nanos, t.desc);
+    }
+  }
+  if (!delta.moments.empty()) {
+    auto l = name_len(delta.moments);
+    spdlog::info("======VARIANCE TIMERS(interval = {:.3}s)======", secs);
+    spdlog::info("{:<{}}TIME\tCOUNT\tRATE\tNS/OP\tSTDDEV\tDESCRIPTION", "NAME", l);
+    for (const auto &t : delta.moments) {
+      auto &agg = t.value;
+      auto avg_nanos = agg.cnt == 0 ? "N/A" : format_time(agg.getAvgNanos());
+      spdlog::info("{:<{}}{}\t{}\t{}\t{}\t{}\t{}", t.name, l, format_time(agg.getNanos()), agg.cnt,
+                   format_rate(agg.cnt / secs), avg_nanos, format_time(agg.getStddevNanos()),
+                   t.desc);
+    }
+  }
+  if (!delta.histograms.empty()) {
+    auto l = name_len(delta.histograms);
+    spdlog::info("======HISTOGRAMS(interval = {:.3}s)======", secs);
+    spdlog::info("{:<{}}COUNT\tRATE\tP50\tP90\tP99\tP999\tDESCRIPTION", "NAME", l);
+    for (const auto &h : delta.histograms) {
+      auto pct = [&](double q) { return format_time(h.value.getPercentileNanos(q)); };
+      spdlog::info("{:<{}}{}\t{}\t{}\t{}\t{}\t{}\t{}", h.name, l, h.value.cnt,
+                   format_rate(h.value.cnt / secs), pct(0.5), pct(0.9), pct(0.99), pct(0.999),
+                   h.desc);
+    }
+  }
+  if (!delta.sampled.empty()) {
+    auto l = name_len(delta.sampled);
+    spdlog::info("======SAMPLED TIMERS(interval = {:.3}s)======", secs);
+    spdlog::info("{:<{}}TIME(EST)\tCOUNT\tSAMPLES\tRATE\tNS/OP\tDESCRIPTION", "NAME", l);
+    for (const auto &t : delta.sampled) {
+      auto &agg = t.value;
+      auto avg_nanos = agg.samples == 0 ? "N/A" : format_time(agg.getAvgNanos());
+      spdlog::info("{:<{}}{}\t{}\t{}\t{}\t{}\t{}", t.name, l, format_time(agg.getNanos()),
+                   agg.cnt, agg.samples, format_rate(agg.cnt / secs), avg_nanos, t.desc);
+    }
+  }
+  if (!delta.cpus.empty()) {
+    auto l = name_len(delta.cpus);
+    spdlog::info("======CPU TIMERS(interval = {:.3}s)======", secs);
+    spdlog::info("{:<{}}TIME\tCOUNT\tRATE\tNS/OP\tMIGRATIONS\tDESCRIPTION", "NAME", l);
+    auto avg = [](const TimerAgg &a) { return a.cnt == 0 ? "N/A" : format_time(a.getAvgNanos()); };
+    for (const auto &t : delta.cpus) {
+      auto &agg = t.value;
+      spdlog::info("{:<{}}{}\t{}\t{}\t{}\t{}\t\t{}", t.name, l, format_time(agg.getNanos()),
+                   agg.cnt, format_rate(agg.cnt / secs), avg(agg), agg.migrations, t.desc);
+      agg.forEachPart([&](const char *kind, size_t id, const TimerAgg &part) {
+        spdlog::info("{:<{}}{}\t{}\t{}\t{}", fmt::format("  {}{}", kind, id), l,
+                     format_time(part.getNanos()), part.cnt, format_rate(part.cnt / secs),
+                     avg(part));
+      });
+    }
+  }
+  auto metrics_title = fmt::format("METRIC TIMERS(interval = {:.3}s)", secs);
+  print_metrics_entries(metrics_title.c_str(), delta.metrics);
+  if (!delta.counters.empty()) {
+    auto l = name_len(delta.counters);
+    spdlog::info("======COUNTERS(interval = {:.3}s)======", secs);
+    spdlog::info("{:<{}}COUNT\tRATE\tNS/OP\tDESCRIPTION", "NAME", l);
+    for (const auto &c : delta.counters) {
+      auto ns_per_op = c.value == 0 ? "N/A" : format_time(window_nanos / c.value);
+      spdlog::info("{:<{}}{}\t{}\t{}\t{}", c.name, l, c.value, format_rate(c.value / secs),
+                   ns_per_op, c.desc);
+    }
+  }
+  print_gauge_entries(delta.gauges);
+  if (!delta.numeric.empty()) {
+    auto l = name_len(delta.numeric);
+    spdlog::info("======NUMERIC STATS(interval = {:.3}s)======", secs);
+    spdlog::info("{:<{}}VALUE\tRATE\tDESCRIPTION", "NAME", l);
+    for (const auto &n : delta.numeric) {
+      char buf[32];
+      auto rate = n.value.total ? format_rate(n.value.get() / secs) : "N/A";
+      spdlog::info("{:<{}}{}\t{}\t{}", n.name, l, n.value.format(buf), rate, n.desc);
+    }
+  }
+  auto derived_title = fmt::format("DERIVED STATS(interval = {:.3}s)", secs);
+  print_derived_entries(derived_title.c_str(), delta.derived);
+}
+
+/** print each timer & counter by thread with the thread's share of it, exited threads get a '*' */
+inline void print_threads(const std::vector<ThreadStats> &threads) {
+  if (threads.empty()) {
+    spdlog::info("NO THREAD STATS");
+    return;
+  }
+  // stat -> the threads that recorded something
+  std::map<const char *, std::vector<std::pair<const ThreadStats *, TimerAgg>>> timers;
+  std::map<const char *, std::vector<std::pair<const ThreadStats *, uint64_t>>> counters;
+  size_t l = 8, lt = 8;
+  auto label = [](const ThreadStats *t) {
+    return fmt::format("{}({}){}", t->tid, t->name, t->exited ? "*" : "");
+  };
+  for (const auto &t : threads) {
+    for (const auto &e : t.timers) {
+      if (e.value.cnt) {
+        timers[e.name].push_back({&t, e.value});
+        l = std::max(l, strlen(e.name) + 2);
+        lt = std::max(lt, label(&t).size() + 2);
+      }
+    }
+    for (const auto &e : t.counters) {
+      if (e.value) {
+        counters[e.name].push_back({&t, e.value});
+        l = std::max(l, strlen(e.name) + 2);
+        lt = std::max(lt, label(&t).size() + 2);
+      }
+    }
+  }
+  if (!timers.empty()) {
+    spdlog::info("======THREAD TIMERS(freq = {:.3}Ghz)======", TimerAgg::freqGhz());
+    spdlog::info("{:<{}}{:<{}}TIME\tCOUNT\tAVERAGE\tSHARE", "NAME", l, "THREAD", lt);
+  }
+  for (const auto &kv : timers) {
+    uint64_t total = 0;
+    for (const auto &row : kv.second) {
+      total += row.second.cycles;
+    }
+    const char *name = kv.first;
+    for (const auto &row : kv.second) {
+      auto &agg = row.second;
+      spdlog::info("{:<{}}{:<{}}{}\t{}\t{}\t{:.1f}%", name, l, label(row.first), lt,
+                   format_time(agg.getNanos()), agg.cnt, format_time(agg.getAvgNanos()),
+                   total ? 100.0 * agg.cycles / total : 0.0);
+      name = "";
+    }
+  }
+  if (!counters.empty()) {
+    spdlog::info("======THREAD COUNTERS======");
+    spdlog::info("{:<{}}{:<{}}COUNT\tSHARE", "NAME", l, "THREAD", lt);
+  }
+  for (const auto &kv : counters) {
+    uint64_t total = 0;
+    for (const auto &row : kv.second) {
+      total += row.second;
+    }
+    const char *name = kv.first;
+    for (const auto &row : kv.second) {
+      spdlog::info("{:<{}}{:<{}}{}\t{:.1f}%", name, l, label(row.first), lt, row.second,
+                   100.0 * row.second / total);
+      name = "";
+    }
+  }
+}
+
+/** print the per-thread view of all timers & counters, see `HWSTAT_THREAD_STATS` */
+inline void print_thread_stats() { print_threads(thread_stats()); }
+
+/** print what happened since the previous call (or since the first call) */
+inline void print_interval_stats() {
+  static std::mutex mtx;
+  static Interval *interval = nullptr;
+  std::lock_guard<std::mutex> guard(mtx);
+  if (!interval) {
+    // leaked on purpose so that it can be used while other statics are being destroyed
+    interval = new Interval();
+    spdlog::info("interval stats start now");
+    return;
+  }
+  print_interval(interval->next());
+}
+
+/** machine-readable exporters
+ * Each one appends a whole `Snapshot` to a caller-provided buffer with `fmt::format_to`, so a
+ * reused buffer only allocates when it has to grow. Values are raw: counts, tsc cycles and
+ * nanoseconds (seconds for Prometheus), with `freq_ghz` to convert between them.
+ */
+namespace exporter {
+
+static inline void append(fmt::memory_buffer &buf, const char *s) {
+  buf.append(s, s + strlen(s));
+}
+
+static inline void json_string(fmt::memory_buffer &buf, const char *s) {
+  buf.push_back('"');
+  for (; *s; s++) {
+    auto c = *s;
+    if (c == '"' || c == '\\') {
+      buf.push_back('\\');
+      buf.push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      fmt::format_to(std::back_inserter(buf), "\\u{:04x}", int(c));
+    } else {
+      buf.push_back(c);
+    }
+  }
+  buf.push_back('"');
+}
+
+// RFC 4180: quote fields that contain separators, double embedded quotes
+static inline void csv_field(fmt::memory_buffer &buf, const char *s) {
+  if (!strpbrk(s, ",\"\r\n")) {
+    append(buf, s);
+    return;
+  }
+  buf.push_back('"');
+  for (; *s; s++) {
+    if (*s == '"') {
+      buf.push_back('"');
+    }
+    buf.push_back(*s);
+  }
+  buf.push_back('"');
+}
+
+// Prometheus spells non-finite values NaN, +Inf & -Inf
+template <typename T> static inline void prom_value(fmt::memory_buffer &buf, T v) {
+  if constexpr (std::is_floating_point_v<T>) {
+    if (!std::isfinite(v)) {
+      append(buf, std::isnan(v) ? "NaN" : v > 0 ? "+Inf" : "-Inf");
+      return;
+    }
+  }
+  fmt::format_to(std::back_inserter(buf), "{}", v);
+}
+
+static inline void prom_label(fmt::memory_buffer &buf, const char *s) {
+  for (; *s; s++) {
+    if (*s == '\\' || *s == '"') {
+      buf.push_back('\\');
+      buf.push_back(*s);
+    } else if (*s == '\n') {
+      append(buf, "\\n");
+    } else {
+      buf.push_back(*s);
+    }
+  }
+}
+
+template <typename F>
+static inline void json_list(fmt::memory_buffer &buf, const char *key, size_t n, F &&item) {
+  fmt::format_to(std::back_inserter(buf), ",\"{}\":[", key);
+  for (size_t i = 0; i < n; i++) {
+    if (i) {
+      buf.push_back(',');
+    }
+    item(i);
+  }
+  buf.push_back(']');
+}
+
+// the fields every timer kind has, for JSON
+template <typename E>
+static inline void json_timer(fmt::memory_buffer &buf, const E &e, double nanos) {
+  append(buf, "{\"name\":");
+  json_string(buf, e.name);
+  append(buf, ",\"desc\":");
+  json_string(buf, e.desc);
+  fmt::format_to(std::back_inserter(buf), ",\"count\":{},\"cycles\":{},\"nanos\":{}", e.value.cnt,
+                 e.value.cycles, nanos);
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+  fmt::format_to(std::back_inserter(buf), ",\"raw_cycles\":{}", e.value.raw_cycles);
+#endif
+}
+
+} // namespace exporter
+
+/** append `snap` as a single JSON object */
+inline void export_json(const Snapshot &snap, fmt::memory_buffer &buf) {
+  using namespace exporter;
+  auto out = std::back_inserter(buf);
+  fmt::format_to(out, "{{\"tsc\":{},\"freq_ghz\":{}", snap.tsc, TimerAgg::freqGhz());
+  json_list(buf, "timers", snap.timers.size(), [&](size_t i) {
+    auto &t = snap.timers[i];
+    json_timer(buf, t, t.value.getNanos());
+    buf.push_back('}');
+  });
+  json_list(buf, "variance_timers", snap.moments.size(), [&](size_t i) {
+    auto &t = snap.moments[i];
+    json_timer(buf, t, t.value.getNanos());
+    fmt::format_to(out, ",\"min_cycles\":{},\"max_cycles\":{},\"stddev_nanos\":{}}}",
+                   t.value.cnt ? t.value.min : 0, t.value.max, t.value.getStddevNanos());
+  });
+  json_list(buf, "histograms", snap.histograms.size(), [&](size_t i) {
+    auto &t = snap.histograms[i];
+    auto &v = t.value;
+    json_timer(buf, t, v.getNanos());
+    fmt::format_to(out,
+                   ",\"max_cycles\":{},\"p50_cycles\":{},\"p90_cycles\":{},\"p99_cycles\":{},"
+                   "\"p999_cycles\":{}}}",
+                   v.max, v.getPercentileCycles(0.5), v.getPercentileCycles(0.9),
+                   v.getPercentileCycles(0.99), v.getPercentileCycles(0.999));
+  });
+  json_list(buf, "sampled_timers", snap.sampled.size(), [&](size_t i) {
+    auto &t = snap.sampled[i];
+    // cycles & nanos are those of the samples, the estimated total is separate
+    json_timer(buf, t, t.value.cycles / TimerAgg::freqGhz());
+    fmt::format_to(out, ",\"samples\":{},\"estimated_nanos\":{}}}", t.value.samples,
+                   t.value.getNanos());
+  });
+  json_list(buf, "cpu_timers", snap.cpus.size(), [&](size_t i) {
+    auto &t = snap.cpus[i];
+    json_timer(buf, t, t.value.getNanos());
+    fmt::format_to(out, ",\"migrations\":{}", t.value.migrations);
+    for (auto which : {"node", "cpu"}) {
+      fmt::format_to(out, ",\"{}s\":[", which);
+      bool first = true;
+      t.value.forEachPart([&](const char *kind, size_t id, const TimerAgg &part) {
+        if (strcmp(kind, which) == 0) {
+          fmt::format_to(out, "{}{{\"{}\":{},\"count\":{},\"cycles\":{},\"nanos\":{}}}",
+                         first ? "" : ",", kind, id, part.cnt, part.cycles, part.getNanos());
+          first = false;
+        }
+      });
+      buf.push_back(']');
+    }
+    buf.push_back('}');
+  });
+  json_list(buf, "metric_timers", snap.metrics.size(), [&](size_t i) {
+    auto &m = snap.metrics[i];
+    append(buf, "{\"name\":");
+    json_string(buf, m.name);
+    append(buf, ",\"desc\":");
+    json_string(buf, m.desc);
+    fmt::format_to(out, ",\"count\":{},\"values\":{{", m.value.cnt);
+    for (size_t j = 0; j < m.value.n; j++) {
+      fmt::format_to(out, "{}\"{}\":{}", j ? "," : "", m.value.names[j], m.value.values[j]);
+    }
+    append(buf, "}}");
+  });
+  json_list(buf, "counters", snap.counters.size(), [&](size_t i) {
+    auto &c = snap.counters[i];
+    append(buf, "{\"name\":");
+    json_string(buf, c.name);
+    append(buf, ",\"desc\":");
+    json_string(buf, c.desc);
+    fmt::format_to(out, ",\"value\":{}}}", c.value);
+  });
+  json_list(buf, "gauges", snap.gauges.size(), [&](size_t i) {
+    auto &g = snap.gauges[i];
+    append(buf, "{\"name\":");
+    json_string(buf, g.name);
+    append(buf, ",\"desc\":");
+    json_string(buf, g.desc);
+    fmt::format_to(out, ",\"value\":{}", g.value.value);
+    if (g.value.has_hwm) {
+      fmt::format_to(out, ",\"hwm\":{}", g.value.hwm);
+    }
+    buf.push_back('}');
+  });
+  json_list(buf, "user", snap.user.size(), [&](size_t i) {
+    auto &u = snap.user[i];
+    append(buf, "{\"name\":");
+    json_string(buf, u.name);
+    append(buf, ",\"desc\":");
+    json_string(buf, u.desc);
+    append(buf, ",\"value\":");
+    json_string(buf, u.value.c_str());
+    buf.push_back('}');
+  });
+  json_list(buf, "numeric", snap.numeric.size(), [&](size_t i) {
+    auto &n = snap.numeric[i];
+    char value[32];
+    append(buf, "{\"name\":");
+    json_string(buf, n.name);
+    append(buf, ",\"desc\":");
+    json_string(buf, n.desc);
+    // JSON has neither NaN nor infinities
+    auto finite = !n.value.real || std::isfinite(n.value.d);
+    fmt::format_to(out, ",\"value\":{},\"total\":{}}}", finite ? n.value.format(value) : "null",
+                   n.value.total);
+  });
+  json_list(buf, "derived", snap.derived.size(), [&](size_t i) {
+    auto &d = snap.derived[i];
+    append(buf, "{\"name\":");
+    json_string(buf, d.name);
+    append(buf, ",\"desc\":");
+    json_string(buf, d.desc);
+    // JSON has no NaN
+    if (std::isnan(d.value.value)) {
+      append(buf, ",\"value\":null");
+    } else {
+      fmt::format_to(out, ",\"value\":{}", d.value.value);
+    }
+    fmt::format_to(out, ",\"per_op\":{}}}", d.value.per_op);
+  });
+  json_list(buf, "threads", snap.threads.size(), [&](size_t i) {
+    auto &t = snap.threads[i];
+    fmt::format_to(out, "{{\"tid\":{},\"name\":", t.tid);
+    json_string(buf, t.name.c_str());
+    fmt::format_to(out, ",\"exited\":{}", t.exited);
+    json_list(buf, "timers", t.timers.size(), [&](size_t j) {
+      json_timer(buf, t.timers[j], t.timers[j].value.getNanos());
+      buf.push_back('}');
+    });
+    json_list(buf, "counters", t.counters.size(), [&](size_t j) {
+      append(buf, "{\"name\":");
+      json_string(buf, t.counters[j].name);
+      fmt::format_to(out, ",\"value\":{}}}", t.counters[j].value);
+    });
+    buf.push_back('}');
+  });
+  buf.push_back('}');
+}
+
+/** append `snap` as CSV rows of `kind,name,field,value`, with a header row */
+inline void export_csv(const Snapshot &snap, fmt::memory_buffer &buf) {
+  using namespace exporter;
+  auto out = std::back_inserter(buf);
+  auto row = [&](const char *kind, const char *name, const char *field, auto value) {
+    fmt::format_to(out, "{},", kind);
+    csv_field(buf, name);
+    fmt::format_to(out, ",{},{}\n", field, value);
+  };
+  auto timer_rows = [&](const char *kind, const auto &t) {
+    row(kind, t.name, "count", t.value.cnt);
+    row(kind, t.name, "cycles", t.value.cycles);
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+    row(kind, t.name, "raw_cycles", t.value.raw_cycles);
+#endif
+  };
+  append(buf, "kind,name,field,value\n");
+  row("snapshot", "", "tsc", snap.tsc);
+  row("snapshot", "", "freq_ghz", TimerAgg::freqGhz());
+  for (auto &t : snap.timers) {
+    timer_rows("timer", t);
+    row("timer", t.name, "nanos", t.value.getNanos());
+  }
+  for (auto &t : snap.moments) {
+    timer_rows("variance_timer", t);
+    row("variance_timer", t.name, "nanos", t.value.getNanos());
+    row("variance_timer", t.name, "min_cycles", t.value.cnt ? t.value.min : 0);
+    row("variance_timer", t.name, "max_cycles", t.value.max);
+    row("variance_timer", t.name, "stddev_nanos", t.value.getStddevNanos());
+  }
+  for (auto &t : snap.histograms) {
+    timer_rows("histogram", t);
+    row("histogram", t.name, "nanos", t.value.getNanos());
+    row("histogram", t.name, "max_cycles", t.value.max);
+    row("histogram", t.name, "p50_cycles", t.value.getPercentileCycles(0.5));
+    row("histogram", t.name, "p90_cycles", t.value.getPercentileCycles(0.9));
+    row("histogram", t.name, "p99_cycles", t.value.getPercentileCycles(0.99));
+    row("histogram", t.name, "p999_cycles", t.value.getPercentileCycles(0.999));
+  }
+  for (auto &t : snap.sampled) {
+    timer_rows("sampled_timer", t);
+    row("sampled_timer", t.name, "samples", t.value.samples);
+    row("sampled_timer", t.name, "estimated_nanos", t.value.getNanos());
+  }
+  for (auto &t : snap.cpus) {
+    timer_rows("cpu_timer", t);
+    row("cpu_timer", t.name, "nanos", t.value.getNanos());
+    row("cpu_timer", t.name, "migrations", t.value.migrations);
+    t.value.forEachPart([&](const char *kind, size_t id, const TimerAgg &part) {
+      char field[32];
+      *fmt::format_to_n(field, sizeof(field) - 1, "{}{}_count", kind, id).out = '\0';
+      row("cpu_timer", t.name, field, part.cnt);
+      *fmt::format_to_n(field, sizeof(field) - 1, "{}{}_cycles", kind, id).out = '\0';
+      row("cpu_timer", t.name, field, part.cycles);
+    });
+  }
+  for (auto &m : snap.metrics) {
+    row("metric_timer", m.name, "count", m.value.cnt);
+    for (size_t j = 0; j < m.value.n; j++) {
+      row("metric_timer", m.name, m.value.names[j], m.value.values[j]);
+    }
+  }
+  for (auto &c : snap.counters) {
+    row("counter", c.name, "value", c.value);
+  }
+  for (auto &g : snap.gauges) {
+    row("gauge", g.name, "value", g.value.value);
+    if (g.value.has_hwm) {
+      row("gauge", g.name, "hwm", g.value.hwm);
+    }
+  }
+  for (auto &u : snap.user) {
+    fmt::format_to(out, "user,");
+    csv_field(buf, u.name);
+    append(buf, ",value,");
+    csv_field(buf, u.value.c_str());
+    buf.push_back('\n');
+  }
+  for (auto &n : snap.numeric) {
+    char value[32];
+    row("numeric", n.name, "value", n.value.format(value));
+  }
+  for (auto &d : snap.derived) {
+    row("derived", d.name, d.value.per_op ? "nanos_per_op" : "ratio", d.value.value);
+  }
 }
 
-template <typename T>
-static inline size_t get_max_strlen(const std::map<const char *, T *> &stats) {
-  size_t ret = 0;
-  for (const auto kv : stats) {
-    ret = std::max(ret, strlen(kv.first));
+/** append `snap` in the Prometheus text exposition format
+ * Stats are labels of a few metric families, e.g. `hwstat_timer_seconds_total{name="parse"}`, so
+ * stat names need no sanitizing. User stats are exported as gauges when their value is a number,
+ * numeric stats that are totals as counters. Cycles & seconds of sampled timers are those of the
+ * timed samples, like in the other exports; their extrapolated totals have families of their own.
+ */
+inline void export_prometheus(const Snapshot &snap, fmt::memory_buffer &buf,
+                              const char *prefix = "hwstat_") {
+  using namespace exporter;
+  auto out = std::back_inserter(buf);
+  // HELP & TYPE of a family are appended along with its first sample, empty families are skipped
+  const char *pending[3] = {};
+  auto family = [&](const char *name, const char *type, const char *help) {
+    pending[0] = name;
+    pending[1] = type;
+    pending[2] = help;
+  };
+  // `key` & `label` add a second label, whose value needs no escaping
+  auto sample = [&](const char *family, const char *name, auto value, const char *key = nullptr,
+                    const char *label = nullptr) {
+    if (pending[0] && strcmp(pending[0], family) == 0) {
+      fmt::format_to(out, "# HELP {}{} {}\n# TYPE {}{} {}\n", prefix, family, pending[2], prefix,
+                     family, pending[1]);
+      pending[0] = nullptr;
+    }
+    fmt::format_to(out, "{}{}{{name=\"", prefix, family);
+    prom_label(buf, name);
+    if (key) {
+      fmt::format_to(out, "\",{}=\"{}", key, label);
+    }
+    append(buf, "\"} ");
+    prom_value(buf, value);
+    buf.push_back('\n');
+  };
+  // all timer kinds share the same families, `raw` is `cycles` with the measurement overhead
+  auto timers = [&](auto &&f) {
+    for (auto &t : snap.timers) {
+      f(t.name, t.value.cnt, t.value.cycles, t.value.getNanos(), t.value.getRawCycles());
+    }
+    for (auto &t : snap.moments) {
+      f(t.name, t.value.cnt, t.value.cycles, t.value.getNanos(), t.value.getRawCycles());
+    }
+    for (auto &t : snap.histograms) {
+      f(t.name, t.value.cnt, t.value.cycles, t.value.getNanos(), t.value.getRawCycles());
+    }
+    for (auto &t : snap.sampled) {
+      f(t.name, t.value.cnt, t.value.cycles, t.value.cycles / TimerAgg::freqGhz(),
+        t.value.getRawCycles());
+    }
+    for (auto &t : snap.cpus) {
+      f(t.name, t.value.cnt, t.value.cycles, t.value.getNanos(), t.value.getRawCycles());
+    }
+    for (auto &m : snap.metrics) {
+      int tsc = m.value.find(metric::Tsc::kName);
+      uint64_t cycles = tsc < 0 ? 0 : m.value.values[tsc];
+      f(m.name, m.value.cnt, cycles, cycles / TimerAgg::freqGhz(), cycles);
+    }
+  };
+  family("timer_calls_total", "counter", "Number of timed calls.");
+  timers([&](const char *name, uint64_t cnt, uint64_t, double, uint64_t) {
+    sample("timer_calls_total", name, cnt);
+  });
+  family("timer_cycles_total", "counter", "Time spent in tsc cycles.");
+  timers([&](const char *name, uint64_t, uint64_t cycles, double, uint64_t) {
+    sample("timer_cycles_total", name, cycles);
+  });
+  family("timer_seconds_total", "counter", "Time spent in seconds.");
+  timers([&](const char *name, uint64_t, uint64_t, double nanos, uint64_t) {
+    sample("timer_seconds_total", name, nanos / 1e9);
+  });
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+  family("timer_raw_cycles_total", "counter",
+         "Time spent in tsc cycles, measurement overhead included.");
+  timers([&](const char *name, uint64_t, uint64_t, double, uint64_t raw) {
+    sample("timer_raw_cycles_total", name, raw);
+  });
+#endif
+  family("timer_samples_total", "counter", "Timed calls of sampled timers.");
+  for (auto &t : snap.sampled) {
+    sample("timer_samples_total", t.name, t.value.samples);
+  }
+  family("timer_estimated_seconds_total", "counter",
+         "Time spent in seconds by sampled timers, extrapolated from the samples to all calls.");
+  for (auto &t : snap.sampled) {
+    sample("timer_estimated_seconds_total", t.name, t.value.getNanos() / 1e9);
+  }
+  if (!snap.histograms.empty()) {
+    family("timer_quantile_seconds", "gauge", "Latency quantiles of histogram timers.");
+    for (auto &h : snap.histograms) {
+      constexpr std::pair<double, const char *> quantiles[] = {
+          {0.5, "0.5"}, {0.9, "0.9"}, {0.99, "0.99"}, {0.999, "0.999"}};
+      for (auto &q : quantiles) {
+        sample("timer_quantile_seconds", h.name, h.value.getPercentileNanos(q.first) / 1e9,
+               "quantile", q.second);
+      }
+    }
+  }
+  if (!snap.cpus.empty()) {
+    family("timer_migrations_total", "counter", "Timed regions that migrated between CPUs.");
+    for (auto &t : snap.cpus) {
+      sample("timer_migrations_total", t.name, t.value.migrations);
+    }
+    // one family per breakdown, which is either "cpu" or "node"
+    auto parts = [&](const char *which, const char *family, auto value) {
+      for (auto &t : snap.cpus) {
+        t.value.forEachPart([&](const char *kind, size_t id, const TimerAgg &part) {
+          if (strcmp(kind, which) == 0) {
+            char label[16];
+            *fmt::format_to_n(label, sizeof(label) - 1, "{}", id).out = '\0';
+            sample(family, t.name, value(part), kind, label);
+          }
+        });
+      }
+    };
+    family("timer_cpu_calls_total", "counter", "Timed calls by the CPU they started on.");
+    parts("cpu", "timer_cpu_calls_total", [](const TimerAgg &a) { return a.cnt; });
+    family("timer_cpu_seconds_total", "counter", "Time spent by the CPU it started on.");
+    parts("cpu", "timer_cpu_seconds_total", [](const TimerAgg &a) { return a.getNanos() / 1e9; });
+    family("timer_node_calls_total", "counter", "Timed calls by the NUMA node they started on.");
+    parts("node", "timer_node_calls_total", [](const TimerAgg &a) { return a.cnt; });
+    family("timer_node_seconds_total", "counter", "Time spent by the NUMA node it started on.");
+    parts("node", "timer_node_seconds_total", [](const TimerAgg &a) { return a.getNanos() / 1e9; });
+  }
+  if (!snap.metrics.empty()) {
+    family("timer_metric_total", "counter", "Metrics recorded by multi-metric timers.");
+    for (auto &m : snap.metrics) {
+      for (size_t j = 0; j < m.value.n; j++) {
+        sample("timer_metric_total", m.name, m.value.values[j], "metric", m.value.names[j]);
+      }
+    }
+  }
+  family("counter_total", "counter", "Counter values.");
+  for (auto &c : snap.counters) {
+    sample("counter_total", c.name, c.value);
+  }
+  if (!snap.gauges.empty()) {
+    family("gauge", "gauge", "Gauge values.");
+    for (auto &g : snap.gauges) {
+      sample("gauge", g.name, g.value.value);
+    }
+    family("gauge_hwm", "gauge", "High-water marks of gauges.");
+    for (auto &g : snap.gauges) {
+      if (g.value.has_hwm) {
+        sample("gauge_hwm", g.name, g.value.hwm);
+      }
+    }
+  }
+  family("user", "gauge", "Numeric user stats.");
+  for (auto &u : snap.user) {
+    char *end;
+    double v = std::strtod(u.value.c_str(), &end);
+    if (!u.value.empty() && !*end) {
+      sample("user", u.name, v);
+    }
+  }
+  for (auto &n : snap.numeric) {
+    if (!n.value.total) {
+      sample("user", n.name, n.value.get());
+    }
+  }
+  family("user_total", "counter", "Numeric user stats that are totals.");
+  for (auto &n : snap.numeric) {
+    if (n.value.total) {
+      sample("user_total", n.name, n.value.get());
+    }
+  }
+  if (!snap.derived.empty()) {
+    family("derived", "gauge", "Ratios of stats, in seconds per op for per-op stats.");
+    for (auto &d : snap.derived) {
+      if (!std::isnan(d.value.value)) {
+        sample("derived", d.name, d.value.per_op ? d.value.value / 1e9 : d.value.value);
+      }
+    }
   }
-  return ret;
 }
 
-template <>
-inline void GlobalStat<PerThreadTimer>::printStats() {
-  if (stats.size() == 0) {
-    spdlog::info("NO TIMERS");
-    return;
+/** background thread that periodically takes a `Snapshot` and publishes it
+ * Readers get the latest snapshot through `latest()` without taking any lock; the returned handle
+ * keeps that snapshot alive, so don't hold on to it for longer than needed since the reporter
+ * waits for it before freeing a replaced snapshot.
+ */
+class Reporter {
+public:
+  using CallbackType = std::function<void(const Snapshot &)>;
+
+  class Handle {
+    Epoch *epoch;
+    unsigned slot;
+    const Snapshot *snap;
+
+  public:
+    Handle(Epoch &epoch) : epoch(&epoch), slot(epoch.enter()) {}
+    Handle(const Handle &) = delete;
+    Handle(Handle &&h) : epoch(h.epoch), slot(h.slot), snap(h.snap) { h.epoch = nullptr; }
+    ~Handle() {
+      if (epoch) {
+        epoch->exit(slot);
+      }
+    }
+    // null until the first snapshot is published
+    const Snapshot *get() const { return snap; }
+    const Snapshot *operator->() const { return snap; }
+    const Snapshot &operator*() const { return *snap; }
+    explicit operator bool() const { return snap != nullptr; }
+    friend class Reporter;
+  };
+
+  /** start reporting
+   * `cb`, if given, is invoked on the reporter thread with every new snapshot, e.g. to log it.
+   */
+  Reporter(std::chrono::milliseconds interval, CallbackType cb = nullptr)
+      : interval(interval), callback(std::move(cb)), worker([this] { run(); }) {}
+  Reporter(const Reporter &) = delete;
+  Reporter(Reporter &&) = delete;
+  ~Reporter() {
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      stopping = true;
+    }
+    cv.notify_one();
+    worker.join();
+    delete current.load();
   }
-  auto l = std::max(8UL, get_max_strlen(stats) + 2);
-  spdlog::info("======TIMERS(freq = {:.3}Ghz)======", TimerAgg::kFreqGhz);
-  spdlog::info("{:<{}}TIME\tCOUNT\tAVERAGE\t\tDESCRIPTION", "NAME", l);
-  for (const auto kv : stats) {
-    auto timer = kv.second;
-    auto agg = timer->calcStat();
-    auto tot_nanos = agg.getNanos();
-    auto avg_nanos = agg.cycles == 0 ? "N/A" : format_time(agg.getAvgNanos());
-    auto avg_cycles = agg.cycles == 0 ? "N/A" : std::to_string(agg.getAvgCycles());
-    spdlog::info("{:<{}}{}\t{}\t{}({} cycles)\t{}", timer->name, l, format_time(tot_nanos), agg.cnt,
-                 avg_nanos, avg_cycles, timer->desc);
+
+  Handle latest() {
+    Handle h(epoch);
+    h.snap = current.load(std::memory_order_acquire);
+    return h;
   }
-}
 
-template <>
-inline void GlobalStat<PerThreadCounter>::printStats() {
-  if (stats.size() == 0) {
-    spdlog::info("NO COUNTERS");
-    return;
+  /** take & publish a snapshot right away on the calling thread */
+  void publish() {
+    std::lock_guard<std::mutex> guard(publishMtx);
+    auto snap = new Snapshot(snapshot());
+    if (callback) {
+      callback(*snap);
+    }
+    auto old = current.exchange(snap, std::memory_order_acq_rel);
+    epoch.synchronize();
+    delete old;
   }
-  auto l = std::max(8UL, get_max_strlen(stats) + 2);
-  spdlog::info("======COUNTERS======");
-  spdlog::info("{:<{}}\tCOUNT\tDESCRIPTION", "NAME", l);
-  for (const auto &kv : stats) {
-    auto counter = kv.second;
-    spdlog::info("{:<{}}{}\t{}", counter->name, l, counter->calcStat(), counter->desc);
+
+private:
+  std::chrono::milliseconds interval;
+  CallbackType callback;
+  std::atomic<Snapshot *> current{nullptr};
+  Epoch epoch;
+  // serializes publishers, which is what `Epoch` requires of removers
+  std::mutex publishMtx;
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool stopping = false;
+  std::thread worker;
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (!stopping) {
+      lock.unlock();
+      publish();
+      lock.lock();
+      cv.wait_for(lock, interval, [this] { return stopping; });
+    }
   }
-}
+};
 
-template <>
-inline void GlobalStat<NoopTimer>::printStats() {}
+/** background thread that prints queued reports, so that the threads asking for them never wait
+ * for the output
+ * A caller claims a place in the queue, takes the snapshot (which reads the stats without any I/O
+ * or long-held lock) and moves it in. Formatting & logging happen on the printer thread, which
+ * holds the queue lock only to pop. At most `kMaxQueued` reports wait to be printed; further ones
+ * are dropped & counted before their snapshot is taken, rather than block the caller. None of this
+ * is async-signal-safe: have a signal handler set a flag that a regular thread checks.
+ */
+class AsyncPrinter {
+public:
+  static constexpr size_t kMaxQueued = 4;
 
-template <>
-inline void GlobalStat<NoopCounter>::printStats() {}
+  static AsyncPrinter &get() {
+    static AsyncPrinter p;
+    return p;
+  }
+  AsyncPrinter(const AsyncPrinter &) = delete;
+  AsyncPrinter(AsyncPrinter &&) = delete;
+  // prints what's still queued
+  ~AsyncPrinter() {
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      stopping = true;
+    }
+    cv.notify_one();
+    worker.join();
+  }
 
-inline void SimpleStat::printStats() {
-  if (stats.size() == 0) {
-    spdlog::info("NO USER STATS");
-    return;
+  /** claim a place in the queue before taking a report, false if it's full and the report is
+   * dropped */
+  bool reserve() {
+    std::lock_guard<std::mutex> guard(mtx);
+    if (queue.size() + reserved >= kMaxQueued) {
+      dropped++;
+      return false;
+    }
+    reserved++;
+    return true;
   }
-  auto l = std::max(8UL, get_max_strlen(stats) + 2);
-  spdlog::info("======USER STATS======");
-  spdlog::info("{:<{}}\tVALUE\tDESCRIPTION", "NAME", l);
-  for (const auto &kv : stats) {
-    auto val = kv.second->callback();
-    spdlog::info("{:<{}}{}\t{}", kv.first, l, val, kv.second->desc);
+  /** queue `report` in a place claimed by `reserve`
+   * With `since_start` it's a plain snapshot, printed as the values since startup.
+   */
+  void push_reserved(Snapshot report, bool since_start = false) {
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      reserved--;
+      queue.push_back({std::move(report), since_start});
+    }
+    cv.notify_one();
+  }
+  /** queue `report` to be printed, false if the queue is full and it's dropped */
+  bool push(Snapshot report) {
+    if (!reserve()) {
+      return false;
+    }
+    push_reserved(std::move(report));
+    return true;
+  }
+
+  /** wait until the reports queued so far are printed */
+  void flush() {
+    std::unique_lock<std::mutex> lock(mtx);
+    idle.wait(lock, [this] { return queue.empty() && reserved == 0 && !printing; });
+  }
+
+private:
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::condition_variable idle;
+  struct Report {
+    Snapshot snap;
+    bool since_start;
+  };
+  std::deque<Report> queue;
+  // places claimed by callers still taking their report
+  size_t reserved = 0;
+  uint64_t dropped = 0;
+  bool printing = false;
+  bool stopping = false;
+  std::thread worker;
+
+  AsyncPrinter() {
+    // the logger must outlive this static, which prints on destruction
+    spdlog::default_logger_raw();
+    worker = std::thread([this] { run(); });
+  }
+
+  static void print(const Snapshot &report) {
+    print_interval(report);
+    if (!report.user.empty()) {
+      size_t l = 8;
+      for (const auto &u : report.user) {
+        l = std::max(l, strlen(u.name) + 2);
+      }
+      spdlog::info("======USER STATS======");
+      spdlog::info("{:<{}}\tVALUE\tDESCRIPTION", "NAME", l);
+      for (const auto &u : report.user) {
+        spdlog::info("{:<{}}{}\t{}", u.name, l, u.value, u.desc);
+      }
+    }
+#ifdef HWSTAT_THREAD_STATS
+    print_threads(report.threads);
+#endif
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (true) {
+      cv.wait(lock, [this] { return stopping || !queue.empty(); });
+      if (queue.empty()) {
+        return;
+      }
+      auto report = std::move(queue.front());
+      queue.pop_front();
+      auto lost = std::exchange(dropped, 0);
+      printing = true;
+      lock.unlock();
+      if (lost) {
+        spdlog::warn("{} stats reports were dropped, printing can't keep up", lost);
+      }
+      // worked out here since it may have to measure the clock
+      if (report.since_start) {
+        report.snap.tsc -= process_start_tsc();
+      }
+      print(report.snap);
+      lock.lock();
+      printing = false;
+      idle.notify_all();
+    }
+  }
+};
+
+/** `print_interval` on the printer thread, e.g. `print_interval_async(since_reset())`
+ * Returns false if the report is dropped, see `AsyncPrinter`.
+ */
+inline bool print_interval_async(Snapshot delta) {
+#ifdef NO_STAT
+  return true;
+#else
+  return AsyncPrinter::get().push(std::move(delta));
+#endif
+}
+
+/** `print_stats` for latency-sensitive threads: the cost on the calling thread is one snapshot
+ * The printer thread reports the values since startup, with rates over the uptime. The call tree
+ * of `HWSTAT_TREE` mode isn't part of a snapshot and is left out.
+ */
+inline bool print_stats_async() {
+#ifdef NO_STAT
+  return true;
+#else
+  // a report that would be dropped isn't taken
+  auto &printer = AsyncPrinter::get();
+  if (!printer.reserve()) {
+    return false;
   }
+  printer.push_reserved(snapshot(), true);
+  return true;
+#endif
 }
 
-inline void print_timer_stats() { GlobalStat<TimerType>::printStats(); }
-inline void print_counter_stats() { GlobalStat<CounterType>::printStats(); }
-inline void print_user_stats() { SimpleStat::printStats(); }
+#ifdef __linux__
+/** shared-memory layout of published snapshots
+ * A segment is a `ShmHeader` followed by `capacity` `ShmEntry`s. It's self-describing: every entry
+ * carries its kind, name, description and the names of its values, so a reader needs nothing but
+ * this layout. The writer updates it under a sequence lock, readers copy it out and retry if `seq`
+ * was odd or changed meanwhile. Bump `kShmVersion` on any layout change.
+ */
+constexpr uint32_t kShmVersion = 1;
+constexpr size_t kShmValues = kMaxMetrics + 1;
 
-inline void print_stats() {
-  print_timer_stats();
-  print_counter_stats();
-  print_user_stats();
+enum class ShmKind : uint32_t { Timer, VarianceTimer, Histogram, SampledTimer, MetricTimer, Counter,
+                                User, CpuTimer, Gauge, Numeric, Derived };
+
+constexpr const char *shm_kind_name(ShmKind k) {
+  constexpr const char *names[] = {"timer",         "variance_timer", "histogram", "sampled_timer",
+                                   "metric_timer",  "counter",        "user",      "cpu_timer",
+                                   "gauge",         "numeric",        "derived"};
+  return names[size_t(k)];
 }
 
+struct ShmEntry {
+  ShmKind kind;
+  uint32_t n;
+  char name[64];
+  char desc[128];
+  // user, numeric & derived stats only
+  char text[64];
+  char fields[kShmValues][16];
+  // gauges' values are signed, cast to `int64_t`
+  uint64_t values[kShmValues];
+};
+
+struct ShmHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t entry_size;
+  uint32_t capacity;
+  // odd while the writer is updating the segment
+  std::atomic<uint64_t> seq;
+  uint64_t pid;
+  double freq_ghz;
+  // tsc reading of the published snapshot
+  uint64_t tsc;
+  uint32_t count;
+  // entries that didn't fit
+  uint32_t dropped;
+  ShmEntry *entries() { return reinterpret_cast<ShmEntry *>(this + 1); }
+  const ShmEntry *entries() const { return reinterpret_cast<const ShmEntry *>(this + 1); }
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared seq must be address-free");
+static_assert(std::is_standard_layout_v<ShmHeader> && std::is_standard_layout_v<ShmEntry>,
+              "shared layout");
+
+/** a named POSIX shared-memory segment that snapshots are published to
+ * Typically fed by a `Reporter`: `Reporter r(1s, [&](auto &snap) { shm.publish(snap); })`. Out of
+ * process readers (see tools/) then poll it without any syscall or lock in this process.
+ */
+class ShmPublisher {
+  std::string name;
+  ShmHeader *header = nullptr;
+  size_t size = 0;
+
+  static void copy(char *dst, size_t n, const char *src) {
+    strncpy(dst, src ? src : "", n - 1);
+    dst[n - 1] = '\0';
+  }
+
+  class Writer {
+    ShmHeader *h;
+    uint32_t count = 0;
+
+  public:
+    Writer(ShmHeader *h) : h(h) { h->dropped = 0; }
+    ~Writer() { h->count = count; }
+    // append the unadjusted cycles of a timer entry, see `HWSTAT_SUBTRACT_OVERHEAD`
+    static void raw(ShmEntry *e, const TimerAgg &v) {
+#ifdef HWSTAT_SUBTRACT_OVERHEAD
+      if (e && e->n < kShmValues) {
+        copy(e->fields[e->n], sizeof(e->fields[0]), "raw_cycles");
+        e->values[e->n++] = v.raw_cycles;
+      }
+#endif
+    }
+    // the new entry, or null if the segment is full
+    ShmEntry *add(ShmKind kind, const char *name, const char *desc,
+                  std::initializer_list<std::pair<const char *, uint64_t>> values) {
+      if (count == h->capacity) {
+        h->dropped++;
+        return nullptr;
+      }
+      auto &e = h->entries()[count++];
+      e.kind = kind;
+      copy(e.name, sizeof(e.name), name);
+      copy(e.desc, sizeof(e.desc), desc);
+      e.text[0] = '\0';
+      e.n = 0;
+      for (auto &v : values) {
+        copy(e.fields[e.n], sizeof(e.fields[0]), v.first);
+        e.values[e.n++] = v.second;
+      }
+      return &e;
+    }
+  };
+
+public:
+  /** create (or replace) the segment `/dev/shm/<name>` with room for `capacity` stats
+   * `name` must start with a '/', as for `shm_open`. The segment is removed on destruction.
+   */
+  ShmPublisher(const char *name, uint32_t capacity = 1024) : name(name) {
+    size = sizeof(ShmHeader) + size_t(capacity) * sizeof(ShmEntry);
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+      spdlog::error("failed to create shared memory segment {}: {}", name, strerror(errno));
+      if (fd >= 0) {
+        close(fd);
+      }
+      return;
+    }
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      spdlog::error("failed to map shared memory segment {}: {}", name, strerror(errno));
+      return;
+    }
+    // the segment is zero-filled, so `seq` starts out even
+    header = static_cast<ShmHeader *>(p);
+    memcpy(header->magic, "HWSTAT\0", 8);
+    header->version = kShmVersion;
+    header->header_size = sizeof(ShmHeader);
+    header->entry_size = sizeof(ShmEntry);
+    header->capacity = capacity;
+    header->pid = getpid();
+  }
+  ~ShmPublisher() {
+    if (header) {
+      munmap(header, size);
+      shm_unlink(name.c_str());
+    }
+  }
+  ShmPublisher(const ShmPublisher &) = delete;
+  ShmPublisher(ShmPublisher &&) = delete;
+  explicit operator bool() const { return header != nullptr; }
+
+  /** write `snap` to the segment, callers must not publish concurrently */
+  void publish(const Snapshot &snap) {
+    if (!header) {
+      return;
+    }
+    header->seq.store(header->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    header->freq_ghz = TimerAgg::freqGhz();
+    header->tsc = snap.tsc;
+    {
+      Writer w(header);
+      for (auto &t : snap.timers) {
+        auto e = w.add(ShmKind::Timer, t.name, t.desc,
+                       {{"count", t.value.cnt}, {"cycles", t.value.cycles}});
+        Writer::raw(e, t.value);
+      }
+      for (auto &t : snap.moments) {
+        auto &v = t.value;
+        auto e = w.add(ShmKind::VarianceTimer, t.name, t.desc,
+                       {{"count", v.cnt},
+                        {"cycles", v.cycles},
+                        {"min_cycles", v.cnt ? v.min : 0},
+                        {"max_cycles", v.max},
+                        {"stddev_cycles", uint64_t(v.getStddevCycles())}});
+        Writer::raw(e, v);
+      }
+      for (auto &t : snap.histograms) {
+        auto &v = t.value;
+        auto e = w.add(ShmKind::Histogram, t.name, t.desc,
+                       {{"count", v.cnt},
+                        {"cycles", v.cycles},
+                        {"max_cycles", v.max},
+                        {"p50_cycles", v.getPercentileCycles(0.5)},
+                        {"p90_cycles", v.getPercentileCycles(0.9)},
+                        {"p99_cycles", v.getPercentileCycles(0.99)},
+                        {"p999_cycles", v.getPercentileCycles(0.999)}});
+        Writer::raw(e, v);
+      }
+      for (auto &t : snap.sampled) {
+        auto e = w.add(ShmKind::SampledTimer, t.name, t.desc,
+                       {{"count", t.value.cnt},
+                        {"samples", t.value.samples},
+                        {"cycles", t.value.cycles}});
+        Writer::raw(e, t.value);
+      }
+      // the per-CPU breakdown doesn't fit in an entry, only the totals are published
+      for (auto &t : snap.cpus) {
+        auto e = w.add(ShmKind::CpuTimer, t.name, t.desc,
+                       {{"count", t.value.cnt},
+                        {"cycles", t.value.cycles},
+                        {"migrations", t.value.migrations}});
+        Writer::raw(e, t.value);
+      }
+      for (auto &m : snap.metrics) {
+        if (auto e = w.add(ShmKind::MetricTimer, m.name, m.desc, {{"count", m.value.cnt}})) {
+          for (size_t j = 0; j < m.value.n && e->n < kShmValues; j++, e->n++) {
+            copy(e->fields[e->n], sizeof(e->fields[0]), m.value.names[j]);
+            e->values[e->n] = m.value.values[j];
+          }
+        }
+      }
+      for (auto &c : snap.counters) {
+        w.add(ShmKind::Counter, c.name, c.desc, {{"value", c.value}});
+      }
+      for (auto &g : snap.gauges) {
+        if (g.value.has_hwm) {
+          w.add(ShmKind::Gauge, g.name, g.desc,
+                {{"value", uint64_t(g.value.value)}, {"hwm", uint64_t(g.value.hwm)}});
+        } else {
+          w.add(ShmKind::Gauge, g.name, g.desc, {{"value", uint64_t(g.value.value)}});
+        }
+      }
+      for (auto &u : snap.user) {
+        if (auto e = w.add(ShmKind::User, u.name, u.desc, {})) {
+          copy(e->text, sizeof(e->text), u.value.c_str());
+        }
+      }
+      for (auto &n : snap.numeric) {
+        if (auto e = w.add(ShmKind::Numeric, n.name, n.desc, {{"total", n.value.total}})) {
+          char value[32];
+          copy(e->text, sizeof(e->text), n.value.format(value));
+        }
+      }
+      for (auto &d : snap.derived) {
+        if (auto e = w.add(ShmKind::Derived, d.name, d.desc, {{"per_op", d.value.per_op}})) {
+          char value[32];
+          *fmt::format_to_n(value, sizeof(value) - 1, "{}", d.value.value).out = '\0';
+          copy(e->text, sizeof(e->text), value);
+        }
+      }
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    header->seq.store(header->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+};
+#endif
+
+/** binary trace file layout, see `TraceWriter`
+ * A `TraceFileHeader` followed by blocks that each start with a `TraceBlock` tag: a `TraceName`
+ * (followed by `len` name bytes) before the first event of a stat, `TraceRecord`s, and
+ * `TraceDropped` whenever a thread's ring overflowed. All fields are native-endian. Bump
+ * `kTraceVersion` on any layout change.
+ */
+constexpr uint32_t kTraceVersion = 1;
+
+enum class TraceBlock : uint32_t { Name = 1, Event, Dropped };
+
+struct TraceFileHeader {
+  char magic[8]; // "HWTRACE\0"
+  uint32_t version;
+  uint32_t reserved;
+  double freq_ghz;
+  uint64_t start_tsc;
+};
+
+struct TraceName {
+  TraceBlock tag;
+  uint32_t id;
+  uint32_t len;
+};
+
+struct TraceRecord {
+  TraceBlock tag;
+  uint32_t stat;
+  uint32_t tid;
+  uint32_t reserved;
+  uint64_t start;
+  uint64_t duration;
+};
+
+struct TraceDropped {
+  TraceBlock tag;
+  uint32_t tid;
+  uint64_t count;
+};
+
+/** record stopwatch events to `path` while alive (requires `HWSTAT_TRACE`)
+ * A background thread drains the per-thread rings every `interval` and appends them to the file,
+ * so a ring only has to hold the events of one interval. Only one writer may exist at a time.
+ * tools/trace2json.cpp converts the file to Chrome trace / Perfetto JSON.
+ */
+class TraceWriter {
+  FILE *file;
+  std::chrono::milliseconds interval;
+  std::map<const char *, uint32_t> ids;
+  std::vector<char> buf;
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool stopping = false;
+  uint32_t session = 0;
+  std::thread worker;
+
+  template <typename T>
+  void append(const T &v) {
+    auto p = reinterpret_cast<const char *>(&v);
+    buf.insert(buf.end(), p, p + sizeof(T));
+  }
+
+  uint32_t id(const char *name) {
+    auto it = ids.find(name);
+    if (it != ids.end()) {
+      return it->second;
+    }
+    uint32_t next = ids.size();
+    ids.emplace(name, next);
+    uint32_t len = strlen(name);
+    append(TraceName{TraceBlock::Name, next, len});
+    buf.insert(buf.end(), name, name + len);
+    return next;
+  }
+
+  // with `Tracer::mutex()` held
+  void drain() {
+    std::vector<TraceRing *> done;
+    Tracer::rings().forEach([&](TraceRing *ring) {
+      // read `closed` first: once set, everything the thread pushed is visible below
+      bool closed = ring->closed.load(std::memory_order_acquire);
+      auto tail = ring->tail.load(std::memory_order_relaxed);
+      auto head = ring->head.load(std::memory_order_acquire);
+      for (; tail != head; tail++) {
+        auto &e = ring->events[tail & (kTraceRing - 1)];
+        if (e.session == session) {
+          append(TraceRecord{TraceBlock::Event, id(e.stat), ring->tid, 0, e.start, e.duration});
+        }
+      }
+      ring->tail.store(tail, std::memory_order_release);
+      auto dropped = ring->dropped.load();
+      if (dropped != ring->reported) {
+        append(TraceDropped{TraceBlock::Dropped, ring->tid, dropped - ring->reported});
+        ring->reported = dropped;
+      }
+      if (closed) {
+        done.push_back(ring);
+      }
+    });
+    // the list is only walked under the lock, so an unlinked ring can go right away
+    for (auto ring : done) {
+      Tracer::rings().remove(ring);
+      delete ring;
+    }
+    if (!buf.empty()) {
+      fwrite(buf.data(), 1, buf.size(), file);
+      buf.clear();
+    }
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (!stopping) {
+      cv.wait_for(lock, interval, [this] { return stopping; });
+      lock.unlock();
+      {
+        std::lock_guard<std::mutex> guard(Tracer::mutex());
+        drain();
+      }
+      lock.lock();
+    }
+  }
+
+public:
+  TraceWriter(const char *path, std::chrono::milliseconds interval = std::chrono::milliseconds(100))
+      : file(fopen(path, "wb")), interval(interval) {
+    if (!file) {
+      spdlog::error("failed to open trace file {}: {}", path, strerror(errno));
+      return;
+    }
+    assert(!Tracer::isActive() && "only one TraceWriter may exist at a time");
+    TraceFileHeader header{};
+    memcpy(header.magic, "HWTRACE\0", 8);
+    header.version = kTraceVersion;
+    header.freq_ghz = TimerAgg::freqGhz();
+    header.start_tsc = DefaultTimerFunc{}();
+    fwrite(&header, sizeof(header), 1, file);
+    {
+      std::lock_guard<std::mutex> guard(Tracer::mutex());
+      // skip what an earlier writer left behind, along with the drops it already reported
+      Tracer::rings().forEach([](TraceRing *ring) {
+        ring->tail.store(ring->head.load(std::memory_order_acquire), std::memory_order_release);
+        ring->reported = ring->dropped.load();
+      });
+      session = ++Tracer::last_session ? Tracer::last_session : ++Tracer::last_session;
+      Tracer::writing = true;
+    }
+    worker = std::thread([this] { run(); });
+    Tracer::session.store(session, std::memory_order_relaxed);
+  }
+  TraceWriter(const TraceWriter &) = delete;
+  TraceWriter(TraceWriter &&) = delete;
+  ~TraceWriter() {
+    if (!file) {
+      return;
+    }
+    Tracer::session.store(0, std::memory_order_relaxed);
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      stopping = true;
+    }
+    cv.notify_one();
+    worker.join();
+    {
+      // pick up whatever was recorded before every thread saw the session end, threads that
+      // exit from now on free their rings themselves
+      std::lock_guard<std::mutex> guard(Tracer::mutex());
+      drain();
+      Tracer::writing = false;
+    }
+    fclose(file);
+  }
+  explicit operator bool() const { return file != nullptr; }
+};
+
 } // namespace hwstat
 
 #define _TIMER_3(_name, _desc, _prefix)                                                            \
   _prefix hwstat::GlobalStat<hwstat::TimerType> gtimer_##_name(#_name, _desc);                     \
-  _prefix thread_local hwstat::TimerType _name(&gtimer_##_name);
+  _prefix _HWSTAT_LOCAL hwstat::TimerType _name(&gtimer_##_name);
 
 #define _COUNTER_3(_name, _desc, _prefix)                                                          \
   _prefix hwstat::GlobalStat<hwstat::CounterType> gcounter_##_name(#_name, _desc);                 \
-  _prefix thread_local hwstat::CounterType _name(&gcounter_##_name);
+  _prefix _HWSTAT_LOCAL hwstat::CounterType _name(&gcounter_##_name);
+
+#define _VARIANCE_TIMER_3(_name, _desc, _prefix)                                                   \
+  _prefix hwstat::GlobalStat<hwstat::MomentsTimerType> gvtimer_##_name(#_name, _desc);             \
+  _prefix thread_local hwstat::MomentsTimerType _name(&gvtimer_##_name);
+
+#define _HISTOGRAM_TIMER_3(_name, _desc, _prefix)                                                  \
+  _prefix hwstat::GlobalStat<hwstat::HistTimerType> ghist_##_name(#_name, _desc);                  \
+  _prefix thread_local hwstat::HistTimerType _name(&ghist_##_name);
+
+#define _SAMPLED_TIMER_4(_name, _desc, _rate, _prefix)                                             \
+  _prefix hwstat::GlobalStat<hwstat::SampledTimerType> gsampled_##_name(#_name, _desc);            \
+  _prefix thread_local hwstat::SampledTimerType _name(&gsampled_##_name, _rate);
+
+#define _CPU_TIMER_3(_name, _desc, _prefix)                                                        \
+  _prefix hwstat::GlobalStat<hwstat::CpuTimerType> gcpu_##_name(#_name, _desc);                    \
+  _prefix thread_local hwstat::CpuTimerType _name(&gcpu_##_name);
+
+#define _PMU_TIMER_3(_name, _desc, _prefix)                                                        \
+  _prefix hwstat::GlobalStat<hwstat::PmuTimerType> gpmu_##_name(#_name, _desc);                    \
+  _prefix hwstat::MetricsRegistration gpmureg_##_name(&gpmu_##_name);                              \
+  _prefix thread_local hwstat::PmuTimerType _name(&gpmu_##_name);
+
+#define _GAUGE_3(_name, _desc, _prefix)                                                            \
+  _prefix hwstat::GlobalStat<hwstat::GaugeType> ggauge_##_name(#_name, _desc);                     \
+  _prefix thread_local hwstat::GaugeType _name(&ggauge_##_name);
+
+#define _HWM_GAUGE_3(_name, _desc, _prefix)                                                        \
+  _prefix hwstat::GlobalStat<hwstat::HwmGaugeType> ghwm_##_name(#_name, _desc);                    \
+  _prefix thread_local hwstat::HwmGaugeType _name(&ghwm_##_name);
+
+#define _TIMER_4(_name, _desc, _prefix, _category)                                                 \
+  _prefix hwstat::GlobalStat<hwstat::CategoryType<hwstat::TimerType, _category>> gtimer_##_name(   \
+      #_name, _desc);                                                                              \
+  _prefix hwstat::CategoryStat<hwstat::TimerType, _category, &gtimer_##_name> _name(               \
+      &gtimer_##_name);
+
+#define _COUNTER_4(_name, _desc, _prefix, _category)                                               \
+  _prefix hwstat::GlobalStat<hwstat::CategoryType<hwstat::CounterType, _category>>                 \
+      gcounter_##_name(#_name, _desc);                                                             \
+  _prefix hwstat::CategoryStat<hwstat::CounterType, _category, &gcounter_##_name> _name(           \
+      &gcounter_##_name);
+
+#define _VARIANCE_TIMER_4(_name, _desc, _prefix, _category)                                        \
+  _prefix hwstat::GlobalStat<hwstat::CategoryType<hwstat::MomentsTimerType, _category>>            \
+      gvtimer_##_name(#_name, _desc);                                                              \
+  _prefix hwstat::CategoryStat<hwstat::MomentsTimerType, _category, &gvtimer_##_name> _name(       \
+      &gvtimer_##_name);
+
+#define _HISTOGRAM_TIMER_4(_name, _desc, _prefix, _category)                                       \
+  _prefix hwstat::GlobalStat<hwstat::CategoryType<hwstat::HistTimerType, _category>>               \
+      ghist_##_name(#_name, _desc);                                                                \
+  _prefix hwstat::CategoryStat<hwstat::HistTimerType, _category, &ghist_##_name> _name(            \
+      &ghist_##_name);
+
+// the sampling rate must be a constant here, it's a template argument of the stat
+#define _SAMPLED_TIMER_5(_name, _desc, _rate, _prefix, _category)                                  \
+  _prefix hwstat::GlobalStat<hwstat::CategoryType<hwstat::SampledTimerType, _category>>            \
+      gsampled_##_name(#_name, _desc);                                                             \
+  _prefix hwstat::CategoryStat<hwstat::SampledTimerType, _category, &gsampled_##_name,             \
+                               uint32_t(_rate)>                                                    \
+      _name(&gsampled_##_name);
+
+#define _CPU_TIMER_4(_name, _desc, _prefix, _category)                                             \
+  _prefix hwstat::GlobalStat<hwstat::CategoryType<hwstat::CpuTimerType, _category>> gcpu_##_name(  \
+      #_name, _desc);                                                                              \
+  _prefix hwstat::CategoryStat<hwstat::CpuTimerType, _category, &gcpu_##_name> _name(&gcpu_##_name);
+
+#define _PMU_TIMER_4(_name, _desc, _prefix, _category)                                             \
+  _prefix hwstat::GlobalStat<hwstat::CategoryType<hwstat::PmuTimerType, _category>> gpmu_##_name(  \
+      #_name, _desc);                                                                              \
+  _prefix hwstat::MetricsRegistration gpmureg_##_name(&gpmu_##_name);                              \
+  _prefix hwstat::CategoryStat<hwstat::PmuTimerType, _category, &gpmu_##_name> _name(&gpmu_##_name);
 
-#define DECLARE_TIMER(_name)                                                                       \
+#define _GAUGE_4(_name, _desc, _prefix, _category)                                                 \
+  _prefix hwstat::GlobalStat<hwstat::CategoryType<hwstat::GaugeType, _category>> ggauge_##_name(   \
+      #_name, _desc);                                                                              \
+  _prefix hwstat::CategoryStat<hwstat::GaugeType, _category, &ggauge_##_name> _name(               \
+      &ggauge_##_name);
+
+#define _HWM_GAUGE_4(_name, _desc, _prefix, _category)                                             \
+  _prefix hwstat::GlobalStat<hwstat::CategoryType<hwstat::HwmGaugeType, _category>> ghwm_##_name(  \
+      #_name, _desc);                                                                              \
+  _prefix hwstat::CategoryStat<hwstat::HwmGaugeType, _category, &ghwm_##_name> _name(&ghwm_##_name);
+
+#define HWSTAT_CATEGORY(_name, _enabled)                                                           \
+  struct _name {                                                                                   \
+    static constexpr bool enabled = _enabled;                                                      \
+  };
+
+#define MULTI_TIMER(_name, _desc, ...)                                                             \
+  static_assert(!hwstat::kAnyCategory<__VA_ARGS__>,                                                \
+                "MULTI_TIMER takes no category, its last arguments are all metrics");              \
+  static hwstat::GlobalStat<hwstat::MetricsTimerType<__VA_ARGS__>> gmulti_##_name(#_name, _desc);  \
+  static hwstat::MetricsRegistration gmultireg_##_name(&gmulti_##_name);                           \
+  static thread_local hwstat::MetricsTimerType<__VA_ARGS__> _name(&gmulti_##_name);
+
+#define _DECLARE_TIMER_2(_name, _category)                                                         \
+  extern hwstat::GlobalStat<hwstat::CategoryType<hwstat::TimerType, _category>> gtimer_##_name;    \
+  extern hwstat::CategoryStat<hwstat::TimerType, _category, &gtimer_##_name> _name;
+
+#define _DECLARE_COUNTER_2(_name, _category)                                                       \
+  extern hwstat::GlobalStat<hwstat::CategoryType<hwstat::CounterType, _category>>                  \
+      gcounter_##_name;                                                                            \
+  extern hwstat::CategoryStat<hwstat::CounterType, _category, &gcounter_##_name> _name;
+
+#define _DECLARE_VARIANCE_TIMER_2(_name, _category)                                                \
+  extern hwstat::GlobalStat<hwstat::CategoryType<hwstat::MomentsTimerType, _category>>             \
+      gvtimer_##_name;                                                                             \
+  extern hwstat::CategoryStat<hwstat::MomentsTimerType, _category, &gvtimer_##_name> _name;
+
+#define _DECLARE_HISTOGRAM_TIMER_2(_name, _category)                                               \
+  extern hwstat::GlobalStat<hwstat::CategoryType<hwstat::HistTimerType, _category>>                \
+      ghist_##_name;                                                                               \
+  extern hwstat::CategoryStat<hwstat::HistTimerType, _category, &ghist_##_name> _name;
+
+#define _DECLARE_SAMPLED_TIMER_3(_name, _rate, _category)                                          \
+  extern hwstat::GlobalStat<hwstat::CategoryType<hwstat::SampledTimerType, _category>>             \
+      gsampled_##_name;                                                                            \
+  extern hwstat::CategoryStat<hwstat::SampledTimerType, _category, &gsampled_##_name,              \
+                              uint32_t(_rate)>                                                     \
+      _name;
+#define _DECLARE_SAMPLED_TIMER_2(_name, _category)                                                 \
+  static_assert(false, "Please provide the sampling rate for DECLARE_SAMPLED_TIMER macro.");
+
+#define _DECLARE_CPU_TIMER_2(_name, _category)                                                     \
+  extern hwstat::GlobalStat<hwstat::CategoryType<hwstat::CpuTimerType, _category>> gcpu_##_name;   \
+  extern hwstat::CategoryStat<hwstat::CpuTimerType, _category, &gcpu_##_name> _name;
+
+#define _DECLARE_PMU_TIMER_2(_name, _category)                                                     \
+  extern hwstat::GlobalStat<hwstat::CategoryType<hwstat::PmuTimerType, _category>> gpmu_##_name;   \
+  extern hwstat::CategoryStat<hwstat::PmuTimerType, _category, &gpmu_##_name> _name;
+
+#define _DECLARE_GAUGE_2(_name, _category)                                                         \
+  extern hwstat::GlobalStat<hwstat::CategoryType<hwstat::GaugeType, _category>> ggauge_##_name;    \
+  extern hwstat::CategoryStat<hwstat::GaugeType, _category, &ggauge_##_name> _name;
+
+#define _DECLARE_HWM_GAUGE_2(_name, _category)                                                     \
+  extern hwstat::GlobalStat<hwstat::CategoryType<hwstat::HwmGaugeType, _category>> ghwm_##_name;   \
+  extern hwstat::CategoryStat<hwstat::HwmGaugeType, _category, &ghwm_##_name> _name;
+
+#define _DECLARE_TIMER_1(_name)                                                                    \
   extern hwstat::GlobalStat<hwstat::TimerType> gtimer_##_name;                                     \
-  extern thread_local hwstat::TimerType _name;
+  extern _HWSTAT_LOCAL hwstat::TimerType _name;
 
-#define DECLARE_COUNTER(_name)                                                                     \
+#define _DECLARE_COUNTER_1(_name)                                                                  \
   extern hwstat::GlobalStat<hwstat::CounterType> gcounter_##_name;                                 \
-  extern thread_local hwstat::CounterType _name;
+  extern _HWSTAT_LOCAL hwstat::CounterType _name;
+
+#define _DECLARE_VARIANCE_TIMER_1(_name)                                                           \
+  extern hwstat::GlobalStat<hwstat::MomentsTimerType> gvtimer_##_name;                             \
+  extern thread_local hwstat::MomentsTimerType _name;
+
+#define _DECLARE_HISTOGRAM_TIMER_1(_name)                                                          \
+  extern hwstat::GlobalStat<hwstat::HistTimerType> ghist_##_name;                                  \
+  extern thread_local hwstat::HistTimerType _name;
+
+#define _DECLARE_SAMPLED_TIMER_1(_name)                                                            \
+  extern hwstat::GlobalStat<hwstat::SampledTimerType> gsampled_##_name;                            \
+  extern thread_local hwstat::SampledTimerType _name;
+
+#define _DECLARE_CPU_TIMER_1(_name)                                                                \
+  extern hwstat::GlobalStat<hwstat::CpuTimerType> gcpu_##_name;                                    \
+  extern thread_local hwstat::CpuTimerType _name;
+
+#define _DECLARE_PMU_TIMER_1(_name)                                                                \
+  extern hwstat::GlobalStat<hwstat::PmuTimerType> gpmu_##_name;                                    \
+  extern thread_local hwstat::PmuTimerType _name;
+
+#define _DECLARE_GAUGE_1(_name)                                                                    \
+  extern hwstat::GlobalStat<hwstat::GaugeType> ggauge_##_name;                                     \
+  extern thread_local hwstat::GaugeType _name;
+
+#define _DECLARE_HWM_GAUGE_1(_name)                                                                \
+  extern hwstat::GlobalStat<hwstat::HwmGaugeType> ghwm_##_name;                                    \
+  extern thread_local hwstat::HwmGaugeType _name;
 
 #define _TIMER_2(_name, _desc) _TIMER_3(_name, _desc, static)
 #define _TIMER_1(_name) _TIMER_2(_name, "")
@@ -369,17 +5587,125 @@ inline void print_stats() {
 #define _COUNTER_2(_name, _desc) _COUNTER_3(_name, _desc, static)
 #define _COUNTER_1(_name) _COUNTER_2(_name, "")
 
+#define _VARIANCE_TIMER_2(_name, _desc) _VARIANCE_TIMER_3(_name, _desc, static)
+#define _VARIANCE_TIMER_1(_name) _VARIANCE_TIMER_2(_name, "")
+
+#define _HISTOGRAM_TIMER_2(_name, _desc) _HISTOGRAM_TIMER_3(_name, _desc, static)
+#define _HISTOGRAM_TIMER_1(_name) _HISTOGRAM_TIMER_2(_name, "")
+
+#define _SAMPLED_TIMER_3(_name, _desc, _rate) _SAMPLED_TIMER_4(_name, _desc, _rate, static)
+#define _SAMPLED_TIMER_2(_name, _desc)                                                             \
+  static_assert(false, "Please provide the sampling rate for SAMPLED_TIMER macro.");
+#define _SAMPLED_TIMER_1(_name) _SAMPLED_TIMER_2(_name, "")
+
+#define _CPU_TIMER_2(_name, _desc) _CPU_TIMER_3(_name, _desc, static)
+#define _CPU_TIMER_1(_name) _CPU_TIMER_2(_name, "")
+
+#define _PMU_TIMER_2(_name, _desc) _PMU_TIMER_3(_name, _desc, static)
+#define _PMU_TIMER_1(_name) _PMU_TIMER_2(_name, "")
+
+#define _GAUGE_2(_name, _desc) _GAUGE_3(_name, _desc, static)
+#define _GAUGE_1(_name) _GAUGE_2(_name, "")
+
+#define _HWM_GAUGE_2(_name, _desc) _HWM_GAUGE_3(_name, _desc, static)
+#define _HWM_GAUGE_1(_name) _HWM_GAUGE_2(_name, "")
+
 #define _STAT_4(_name, _func, _desc, _prefix)                                                      \
   _prefix hwstat::SimpleStat gstat_##_name(#_name, _func, _desc);
 #define _STAT_3(_name, _func, _desc) _STAT_4(_name, _func, _desc, static)
 #define _STAT_2(_name, _func) _STAT_3(_name, _func, "")
 #define _STAT_1(_x) static_assert(false, "Please provide at least two arguments for _STAT macro.");
 
+#define _NUMERIC_STAT_4(_name, _func, _desc, _prefix)                                              \
+  _prefix hwstat::NumericStat gnum_##_name(#_name, _func, _desc);
+#define _NUMERIC_STAT_3(_name, _func, _desc) _NUMERIC_STAT_4(_name, _func, _desc, static)
+#define _NUMERIC_STAT_2(_name, _func) _NUMERIC_STAT_3(_name, _func, "")
+#define _NUMERIC_STAT_1(_x)                                                                        \
+  static_assert(false, "Please provide at least two arguments for NUMERIC_STAT macro.");
+
+#define _TOTAL_STAT_4(_name, _func, _desc, _prefix)                                                \
+  _prefix hwstat::NumericStat gnum_##_name(#_name, _func, _desc, true);
+#define _TOTAL_STAT_3(_name, _func, _desc) _TOTAL_STAT_4(_name, _func, _desc, static)
+#define _TOTAL_STAT_2(_name, _func) _TOTAL_STAT_3(_name, _func, "")
+#define _TOTAL_STAT_1(_x)                                                                          \
+  static_assert(false, "Please provide at least two arguments for TOTAL_STAT macro.");
+
+#define _DERIVED_STAT(_name, _op, _num, _den, _desc, _prefix)                                      \
+  static_assert(sizeof(_num) && sizeof(_den), "operands of a derived stat must be stats");         \
+  _prefix hwstat::DerivedStat gderived_##_name(#_name, hwstat::DerivedStat::_op, #_num, #_den,     \
+                                               _desc);
+#define _DERIVED_STAT_2(...)                                                                       \
+  static_assert(false, "Please provide a name and two stats for RATIO & PER_OP macros.");
+#define _RATIO_5(_name, _num, _den, _desc, _prefix)                                                \
+  _DERIVED_STAT(_name, Ratio, _num, _den, _desc, _prefix)
+#define _RATIO_4(_name, _num, _den, _desc) _RATIO_5(_name, _num, _den, _desc, static)
+#define _RATIO_3(_name, _num, _den) _RATIO_4(_name, _num, _den, "")
+#define _PER_OP_5(_name, _timer, _counter, _desc, _prefix)                                         \
+  _DERIVED_STAT(_name, PerOp, _timer, _counter, _desc, _prefix)
+#define _PER_OP_4(_name, _timer, _counter, _desc) _PER_OP_5(_name, _timer, _counter, _desc, static)
+#define _PER_OP_3(_name, _timer, _counter) _PER_OP_4(_name, _timer, _counter, "")
+
+#define _GET_MACRO_2(_2, _1, _name, ...) _name
 #define _GET_MACRO_3(_3, _2, _1, _name, ...) _name
 #define _GET_MACRO_4(_4, _3, _2, _1, _name, ...) _name
+#define _GET_MACRO_5(_5, _4, _3, _2, _1, _name, ...) _name
+
+#define TIMER(...)                                                                                 \
+  _GET_MACRO_4(__VA_ARGS__, _TIMER_4, _TIMER_3, _TIMER_2, _TIMER_1)(__VA_ARGS__)
+#define VARIANCE_TIMER(...)                                                                        \
+  _GET_MACRO_4(__VA_ARGS__, _VARIANCE_TIMER_4, _VARIANCE_TIMER_3, _VARIANCE_TIMER_2,               \
+               _VARIANCE_TIMER_1)                                                                  \
+  (__VA_ARGS__)
+#define HISTOGRAM_TIMER(...)                                                                       \
+  _GET_MACRO_4(__VA_ARGS__, _HISTOGRAM_TIMER_4, _HISTOGRAM_TIMER_3, _HISTOGRAM_TIMER_2,            \
+               _HISTOGRAM_TIMER_1)                                                                 \
+  (__VA_ARGS__)
+#define SAMPLED_TIMER(...)                                                                         \
+  _GET_MACRO_5(__VA_ARGS__, _SAMPLED_TIMER_5, _SAMPLED_TIMER_4, _SAMPLED_TIMER_3,                  \
+               _SAMPLED_TIMER_2, _SAMPLED_TIMER_1)                                                 \
+  (__VA_ARGS__)
+#define CPU_TIMER(...)                                                                             \
+  _GET_MACRO_4(__VA_ARGS__, _CPU_TIMER_4, _CPU_TIMER_3, _CPU_TIMER_2, _CPU_TIMER_1)(__VA_ARGS__)
+#define PMU_TIMER(...)                                                                             \
+  _GET_MACRO_4(__VA_ARGS__, _PMU_TIMER_4, _PMU_TIMER_3, _PMU_TIMER_2, _PMU_TIMER_1)(__VA_ARGS__)
+#define COUNTER(...)                                                                               \
+  _GET_MACRO_4(__VA_ARGS__, _COUNTER_4, _COUNTER_3, _COUNTER_2, _COUNTER_1)(__VA_ARGS__)
+
+#define GAUGE(...) _GET_MACRO_4(__VA_ARGS__, _GAUGE_4, _GAUGE_3, _GAUGE_2, _GAUGE_1)(__VA_ARGS__)
+#define HWM_GAUGE(...)                                                                             \
+  _GET_MACRO_4(__VA_ARGS__, _HWM_GAUGE_4, _HWM_GAUGE_3, _HWM_GAUGE_2, _HWM_GAUGE_1)(__VA_ARGS__)
 
-#define TIMER(...) _GET_MACRO_3(__VA_ARGS__, _TIMER_3, _TIMER_2, _TIMER_1)(__VA_ARGS__)
-#define COUNTER(...) _GET_MACRO_3(__VA_ARGS__, _COUNTER_3, _COUNTER_2, _COUNTER_1)(__VA_ARGS__)
+#define DECLARE_TIMER(...)                                                                         \
+  _GET_MACRO_2(__VA_ARGS__, _DECLARE_TIMER_2, _DECLARE_TIMER_1)(__VA_ARGS__)
+#define DECLARE_COUNTER(...)                                                                       \
+  _GET_MACRO_2(__VA_ARGS__, _DECLARE_COUNTER_2, _DECLARE_COUNTER_1)(__VA_ARGS__)
+#define DECLARE_VARIANCE_TIMER(...)                                                                \
+  _GET_MACRO_2(__VA_ARGS__, _DECLARE_VARIANCE_TIMER_2, _DECLARE_VARIANCE_TIMER_1)(__VA_ARGS__)
+#define DECLARE_HISTOGRAM_TIMER(...)                                                               \
+  _GET_MACRO_2(__VA_ARGS__, _DECLARE_HISTOGRAM_TIMER_2, _DECLARE_HISTOGRAM_TIMER_1)(__VA_ARGS__)
+#define DECLARE_SAMPLED_TIMER(...)                                                                 \
+  _GET_MACRO_3(__VA_ARGS__, _DECLARE_SAMPLED_TIMER_3, _DECLARE_SAMPLED_TIMER_2,                    \
+               _DECLARE_SAMPLED_TIMER_1)                                                           \
+  (__VA_ARGS__)
+#define DECLARE_CPU_TIMER(...)                                                                     \
+  _GET_MACRO_2(__VA_ARGS__, _DECLARE_CPU_TIMER_2, _DECLARE_CPU_TIMER_1)(__VA_ARGS__)
+#define DECLARE_PMU_TIMER(...)                                                                     \
+  _GET_MACRO_2(__VA_ARGS__, _DECLARE_PMU_TIMER_2, _DECLARE_PMU_TIMER_1)(__VA_ARGS__)
+#define DECLARE_GAUGE(...)                                                                         \
+  _GET_MACRO_2(__VA_ARGS__, _DECLARE_GAUGE_2, _DECLARE_GAUGE_1)(__VA_ARGS__)
+#define DECLARE_HWM_GAUGE(...)                                                                     \
+  _GET_MACRO_2(__VA_ARGS__, _DECLARE_HWM_GAUGE_2, _DECLARE_HWM_GAUGE_1)(__VA_ARGS__)
 #define STAT(...) _GET_MACRO_4(__VA_ARGS__, _STAT_4, _STAT_3, _STAT_2, _STAT_1)(__VA_ARGS__)
+#define RATIO(...)                                                                                 \
+  _GET_MACRO_5(__VA_ARGS__, _RATIO_5, _RATIO_4, _RATIO_3, _DERIVED_STAT_2, _DERIVED_STAT_2)        \
+  (__VA_ARGS__)
+#define PER_OP(...)                                                                                \
+  _GET_MACRO_5(__VA_ARGS__, _PER_OP_5, _PER_OP_4, _PER_OP_3, _DERIVED_STAT_2, _DERIVED_STAT_2)     \
+  (__VA_ARGS__)
+#define NUMERIC_STAT(...)                                                                          \
+  _GET_MACRO_4(__VA_ARGS__, _NUMERIC_STAT_4, _NUMERIC_STAT_3, _NUMERIC_STAT_2, _NUMERIC_STAT_1)    \
+  (__VA_ARGS__)
+#define TOTAL_STAT(...)                                                                            \
+  _GET_MACRO_4(__VA_ARGS__, _TOTAL_STAT_4, _TOTAL_STAT_3, _TOTAL_STAT_2, _TOTAL_STAT_1)(__VA_ARGS__)
 
 #endif // _HWSTAT_H
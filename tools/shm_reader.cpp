@@ -0,0 +1,118 @@
+// Print the stats a process publishes with `hwstat::ShmPublisher`.
+//
+//   g++ -std=c++17 -O2 -I.. shm_reader.cpp -o shm_reader -lspdlog -lfmt
+//   ./shm_reader /myapp        # print once
+//   ./shm_reader /myapp 1000   # print every second
+//
+// The segment is only read, the publishing process is never interrupted.
+
+#include "hwstat.h"
+
+#include <cinttypes>
+#include <cstdio>
+
+using namespace hwstat;
+
+static const ShmHeader *map_segment(const char *name, size_t &size) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    fprintf(stderr, "can't open %s: %s\n", name, strerror(errno));
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(ShmHeader)) {
+    fprintf(stderr, "%s is not a stats segment\n", name);
+    close(fd);
+    return nullptr;
+  }
+  size = st.st_size;
+  void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "can't map %s: %s\n", name, strerror(errno));
+    return nullptr;
+  }
+  auto h = static_cast<const ShmHeader *>(p);
+  if (memcmp(h->magic, "HWSTAT\0", 8) != 0 || h->version != kShmVersion ||
+      h->header_size != sizeof(ShmHeader) || h->entry_size != sizeof(ShmEntry) ||
+      sizeof(ShmHeader) + size_t(h->capacity) * sizeof(ShmEntry) > size) {
+    fprintf(stderr, "%s has an unsupported layout (version %u)\n", name, h->version);
+    munmap(p, size);
+    return nullptr;
+  }
+  return h;
+}
+
+// copy a consistent version of the segment, false if the writer never let go
+static bool read_segment(const ShmHeader *h, size_t size, std::vector<char> &out) {
+  out.resize(size);
+  for (int attempt = 0; attempt < 1000; attempt++) {
+    auto seq = h->seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      std::this_thread::yield();
+      continue;
+    }
+    memcpy(out.data(), static_cast<const void *>(h), size);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (h->seq.load(std::memory_order_relaxed) == seq) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void print(const ShmHeader *h) {
+  printf("pid %" PRIu64 ", tsc %" PRIu64 ", freq %.3fGhz, %u stats", h->pid, h->tsc, h->freq_ghz,
+         h->count);
+  if (h->dropped) {
+    printf(" (%u dropped)", h->dropped);
+  }
+  printf("\n");
+  for (uint32_t i = 0; i < h->count && i < h->capacity; i++) {
+    auto &e = h->entries()[i];
+    if (e.kind > ShmKind::Derived) {
+      continue;
+    }
+    printf("%s\t%s", shm_kind_name(e.kind), e.name);
+    for (uint32_t j = 0; j < e.n && j < kShmValues; j++) {
+      if (e.kind == ShmKind::Gauge) {
+        printf("\t%s=%" PRId64, e.fields[j], int64_t(e.values[j]));
+      } else {
+        printf("\t%s=%" PRIu64, e.fields[j], e.values[j]);
+      }
+    }
+    if (e.kind == ShmKind::User || e.kind == ShmKind::Numeric || e.kind == ShmKind::Derived) {
+      printf("\tvalue=%s", e.text);
+    }
+    if (e.desc[0]) {
+      printf("\t# %s", e.desc);
+    }
+    printf("\n");
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <segment name> [interval ms]\n", argv[0]);
+    return 1;
+  }
+  size_t size;
+  auto h = map_segment(argv[1], size);
+  if (!h) {
+    return 1;
+  }
+  int interval_ms = argc > 2 ? atoi(argv[2]) : 0;
+  std::vector<char> copy;
+  do {
+    if (!read_segment(h, size, copy)) {
+      fprintf(stderr, "segment is being written continuously, giving up\n");
+      return 1;
+    }
+    print(reinterpret_cast<const ShmHeader *>(copy.data()));
+    if (interval_ms > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+      printf("\n");
+    }
+  } while (interval_ms > 0);
+  return 0;
+}
@@ -0,0 +1,94 @@
+// Convert a trace recorded by `hwstat::TraceWriter` to Chrome trace / Perfetto JSON.
+//
+//   g++ -std=c++17 -O2 -I.. trace2json.cpp -o trace2json -lspdlog -lfmt
+//   ./trace2json app.trace > app.json   # then open it in ui.perfetto.dev or chrome://tracing
+//
+// Timestamps are in microseconds since the writer started.
+
+#include "hwstat.h"
+
+#include <cinttypes>
+#include <cstdio>
+
+using namespace hwstat;
+
+template <typename T>
+static bool read(FILE *f, T &v) {
+  return fread(&v, sizeof(T), 1, f) == 1;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+    return 1;
+  }
+  FILE *f = fopen(argv[1], "rb");
+  if (!f) {
+    fprintf(stderr, "can't open %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  TraceFileHeader header;
+  if (!read(f, header) || memcmp(header.magic, "HWTRACE\0", 8) != 0 ||
+      header.version != kTraceVersion || header.freq_ghz <= 0) {
+    fprintf(stderr, "%s is not a supported trace file\n", argv[1]);
+    return 1;
+  }
+  auto us = [&](uint64_t cycles) { return cycles / header.freq_ghz / 1000; };
+
+  std::vector<std::string> names;
+  fmt::memory_buffer name;
+  uint64_t events = 0, dropped = 0;
+  bool bad = false;
+  const char *sep = "";
+  printf("{\"traceEvents\":[\n");
+  TraceBlock tag;
+  while (read(f, tag)) {
+    // every block starts with its tag, read the rest of it in place
+    fseek(f, -long(sizeof(tag)), SEEK_CUR);
+    if (tag == TraceBlock::Name) {
+      TraceName n;
+      if (!read(f, n) || n.id != names.size()) {
+        bad = true;
+        break;
+      }
+      std::string s(n.len, '\0');
+      if (fread(s.data(), 1, s.size(), f) != s.size()) {
+        bad = true;
+        break;
+      }
+      names.push_back(std::move(s));
+    } else if (tag == TraceBlock::Event) {
+      TraceRecord r;
+      if (!read(f, r) || r.stat >= names.size()) {
+        bad = true;
+        break;
+      }
+      name.clear();
+      exporter::json_string(name, names[r.stat].c_str());
+      // events recorded before the writer started (still in a ring) are clamped to 0
+      auto ts = r.start > header.start_tsc ? us(r.start - header.start_tsc) : 0.0;
+      printf("%s{\"name\":%.*s,\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}", sep,
+             int(name.size()), name.data(), ts, us(r.duration), r.tid);
+      sep = ",\n";
+      events++;
+    } else if (tag == TraceBlock::Dropped) {
+      TraceDropped d;
+      if (!read(f, d)) {
+        bad = true;
+        break;
+      }
+      dropped += d.count;
+    } else {
+      bad = true;
+      break;
+    }
+  }
+  printf("\n],\"displayTimeUnit\":\"ns\"}\n");
+  fclose(f);
+  fprintf(stderr, "%" PRIu64 " events, %" PRIu64 " dropped\n", events, dropped);
+  if (bad) {
+    fprintf(stderr, "%s is truncated or corrupt, stopped early\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}